@@ -0,0 +1,107 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#include "admission.h"
+
+#include <algorithm>
+
+#include "half-open.h"
+#include "memory-budget.h"
+#include "state.h"
+
+bool RateLimiter::refill(double now, double per_second) {
+    limited_ = per_second > 0;
+    if (!limited_) {
+        return true;
+    }
+
+    double max_tokens = std::max(per_second, 1.0);
+    tokens_ = std::min(max_tokens,
+                       tokens_ + (now - last_refill_) * per_second);
+    last_refill_ = now;
+
+    return tokens_ >= 1;
+}
+
+// Is "count" at or over "limit" (with zero meaning no limit)?
+static bool at_limit(uint32_t limit, size_t count) {
+    return limit && count >= limit;
+}
+
+AdmissionControl::AdmissionControl(State* state)
+    : state_(state),
+      admitted_(state->stats.counter("admission.admitted")),
+      rate_limited_(state->stats.counter("admission.rate_limited")),
+      half_open_limited_(state->stats.counter("admission.half_open_limited")),
+      connection_limited_(state->stats.counter("admission.connection_limited")),
+      memory_limited_(state->stats.counter("admission.memory_limited")) {
+    state->stats.add_gauge("connections.established", [state] () {
+            return state->connections->size();
+        });
+    state->stats.add_gauge("connections.half_open", [state] () {
+            return state->half_open->size();
+        });
+}
+
+bool AdmissionControl::admit(Profile* profile) {
+    const AdmissionLimits& global = state_->config.config().admission();
+    const AdmissionLimits& local = profile->profile_config().admission();
+    ProfileAdmission* admission = profile->admission();
+
+    if (admission->rate_limited == NULL) {
+        const std::string prefix =
+            "profile." + profile->profile_config().id() + ".admission.";
+        admission->rate_limited =
+            state_->stats.counter(prefix + "rate_limited");
+        admission->half_open_limited =
+            state_->stats.counter(prefix + "half_open_limited");
+        admission->connection_limited =
+            state_->stats.counter(prefix + "connection_limited");
+    }
+
+    if (state_->memory->refusing_connections()) {
+        ++*memory_limited_;
+        return false;
+    }
+
+    size_t half_open = state_->half_open->size();
+    size_t total = half_open + state_->connections->size();
+
+    if (at_limit(global.max_half_open_connections(), half_open)) {
+        ++*half_open_limited_;
+        return false;
+    }
+    if (at_limit(global.max_connections(), total)) {
+        ++*connection_limited_;
+        return false;
+    }
+    if (at_limit(local.max_half_open_connections(), admission->half_open)) {
+        ++*admission->half_open_limited;
+        return false;
+    }
+    if (at_limit(local.max_connections(),
+                 admission->half_open + admission->connections)) {
+        ++*admission->connection_limited;
+        return false;
+    }
+
+    // Check the rate limits last, so that SYNs rejected for other reasons
+    // don't use up tokens.
+    ev_tstamp now = ev_now(state_->loop);
+    if (!admission->rate.refill(now, local.max_new_connections_per_second())) {
+        ++*admission->rate_limited;
+        return false;
+    }
+    if (!rate_.refill(now, global.max_new_connections_per_second())) {
+        ++*rate_limited_;
+        return false;
+    }
+
+    admission->rate.consume();
+    rate_.consume();
+    ++*admitted_;
+
+    return true;
+}
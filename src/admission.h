@@ -0,0 +1,98 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+// Admission control for new connections: rate limits on connection setup,
+// and limits on the number of half-open and total connections, both
+// globally and per profile.
+
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "base.h"
+
+class Profile;
+struct State;
+
+// A token bucket limiting how often something can happen. The rate
+// is passed in on every call rather than stored, so that it can follow
+// configuration reloads.
+class RateLimiter {
+public:
+    RateLimiter()
+        : limited_(false),
+          tokens_(0),
+          last_refill_(0) {
+    }
+
+    // Refill the bucket up to time "now" at a rate of "per_second" tokens
+    // per second, with a maximum of one second's worth of tokens. Return
+    // true if a token is available. A rate of zero means unlimited.
+    bool refill(double now, double per_second);
+    // Use up one token. Only valid if refill() just returned true.
+    void consume() {
+        if (limited_) {
+            tokens_ -= 1;
+        }
+    }
+
+private:
+    bool limited_;
+    double tokens_;
+    double last_refill_;
+};
+
+// Per-profile admission state. Unlike the rest of the profile, this is
+// runtime state that's kept across configuration reloads.
+struct ProfileAdmission {
+    ProfileAdmission()
+        : half_open(0),
+          connections(0),
+          rate_limited(NULL),
+          half_open_limited(NULL),
+          connection_limited(NULL) {
+    }
+
+    RateLimiter rate;
+    // Number of half-open / fully established connections using the
+    // profile.
+    uint32_t half_open;
+    uint32_t connections;
+
+    // Number of SYNs dropped due to each of the limits of this profile.
+    // Set up on first use.
+    uint64_t* rate_limited;
+    uint64_t* half_open_limited;
+    uint64_t* connection_limited;
+};
+
+class AdmissionControl {
+public:
+    explicit AdmissionControl(State* state);
+
+    // Should we accept a new connection for this profile? If yes, the
+    // caller must start tracking the connection in the half-open table.
+    bool admit(Profile* profile);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(AdmissionControl);
+
+    State* state_;
+    // Global connection setup rate limit.
+    RateLimiter rate_;
+
+    // Number of SYNs accepted, and dropped due to each of the global
+    // limits.
+    uint64_t* admitted_;
+    uint64_t* rate_limited_;
+    uint64_t* half_open_limited_;
+    uint64_t* connection_limited_;
+    // Number of SYNs dropped due to the memory budget.
+    uint64_t* memory_limited_;
+};
+
+#endif // _ADMISSION_H_
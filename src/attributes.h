@@ -8,10 +8,12 @@
 
 #ifdef __GNUC__
 #define CHECK_PRINTF_ARGS __attribute__((format(printf, 1, 2)))
+#define CHECK_SITE_PRINTF_ARGS __attribute__((format(printf, 2, 3)))
 #define NO_RETURN __attribute__((noreturn))
 #define IGNORABLE __attribute__((unused))
 #else
 #define CHECK_PRINTF_ARGS
+#define CHECK_SITE_PRINTF_ARGS
 #define NO_RETURN
 #define IGNORABLE
 #endif
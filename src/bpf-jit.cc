@@ -0,0 +1,546 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#include "bpf-jit.h"
+
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
+#include <vector>
+
+#include "log.h"
+
+#if defined(__x86_64__)
+
+// Register use in the generated code, which is a leaf function called
+// as Function (System V ABI):
+//
+//   eax  A (and the return value)
+//   ecx  X (so that it can be used as a shift count)
+//   rdi  packet
+//   esi  wirelen
+//   r10  buflen (moved out of edx, which div clobbers)
+//   r8, r9, edx  scratch
+//
+// The scratch memory M[] lives in the red zone below the stack pointer.
+static const int kMemOffset = -4 * BPF_MEMWORDS;
+
+// The x86 condition codes used for jumps.
+enum Condition {
+    BELOW = 0x2,
+    ABOVE_OR_EQUAL = 0x3,
+    EQUAL = 0x4,
+    NOT_EQUAL = 0x5,
+    BELOW_OR_EQUAL = 0x6,
+    ABOVE = 0x7,
+};
+
+class Assembler {
+public:
+    // Instruction "count" of the program is the shared "return 0" exit.
+    explicit Assembler(size_t count)
+        : offsets_(count + 1) {
+    }
+
+    const std::vector<uint8_t>& code() const { return code_; }
+    // The label of the exit.
+    size_t exit() const { return offsets_.size() - 1; }
+
+    void emit(std::initializer_list<uint8_t> bytes) {
+        code_.insert(code_.end(), bytes);
+    }
+    void emit32(uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            code_.push_back(value >> (8 * i));
+        }
+    }
+
+    // The next code emitted is for this program instruction.
+    void label(size_t insn) {
+        offsets_[insn] = code_.size();
+    }
+
+    // Jump to a program instruction (or the exit).
+    void jump(size_t target) {
+        emit({ 0xe9 });
+        fixup(target);
+    }
+    void jump_if(Condition condition, size_t target) {
+        emit({ 0x0f, static_cast<uint8_t>(0x80 | condition) });
+        fixup(target);
+    }
+
+    // Resolve the jumps, once all labels are known.
+    void finish() {
+        for (auto& jump : jumps_) {
+            int32_t rel = offsets_[jump.second] - (jump.first + 4);
+            memcpy(&code_[jump.first], &rel, sizeof(rel));
+        }
+    }
+
+private:
+    void fixup(size_t target) {
+        jumps_.push_back(std::make_pair(code_.size(), target));
+        emit32(0);
+    }
+
+    std::vector<uint8_t> code_;
+    std::vector<size_t> offsets_;
+    // Location of each rel32, and its target instruction.
+    std::vector<std::pair<size_t, size_t> > jumps_;
+};
+
+// Is this an instruction the interpreter knows? The rest of the
+// compiler can then go by the class and mode bits alone.
+static bool known_opcode(uint16_t code) {
+    switch (code) {
+    case BPF_LD|BPF_W|BPF_ABS:
+    case BPF_LD|BPF_H|BPF_ABS:
+    case BPF_LD|BPF_B|BPF_ABS:
+    case BPF_LD|BPF_W|BPF_IND:
+    case BPF_LD|BPF_H|BPF_IND:
+    case BPF_LD|BPF_B|BPF_IND:
+    case BPF_LD|BPF_W|BPF_LEN:
+    case BPF_LD|BPF_IMM:
+    case BPF_LD|BPF_MEM:
+    case BPF_LDX|BPF_W|BPF_LEN:
+    case BPF_LDX|BPF_W|BPF_IMM:
+    case BPF_LDX|BPF_MEM:
+    case BPF_LDX|BPF_MSH|BPF_B:
+    case BPF_ST:
+    case BPF_STX:
+    case BPF_RET|BPF_K:
+    case BPF_RET|BPF_A:
+    case BPF_JMP|BPF_JA:
+    case BPF_ALU|BPF_NEG:
+    case BPF_MISC|BPF_TAX:
+    case BPF_MISC|BPF_TXA:
+        return true;
+    }
+
+    if (BPF_CLASS(code) == BPF_JMP) {
+        switch (code & ~BPF_X) {
+        case BPF_JMP|BPF_JEQ:
+        case BPF_JMP|BPF_JGT:
+        case BPF_JMP|BPF_JGE:
+        case BPF_JMP|BPF_JSET:
+            return true;
+        }
+    } else if (BPF_CLASS(code) == BPF_ALU) {
+        switch (code & ~BPF_X) {
+        case BPF_ALU|BPF_ADD:
+        case BPF_ALU|BPF_SUB:
+        case BPF_ALU|BPF_MUL:
+        case BPF_ALU|BPF_DIV:
+        case BPF_ALU|BPF_MOD:
+        case BPF_ALU|BPF_AND:
+        case BPF_ALU|BPF_OR:
+        case BPF_ALU|BPF_XOR:
+        case BPF_ALU|BPF_LSH:
+        case BPF_ALU|BPF_RSH:
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint8_t mem_offset(uint32_t k) {
+    return static_cast<uint8_t>(kMemOffset + 4 * k);
+}
+
+// Load "size" bytes at offset r8 into eax (or the MSH of one byte into
+// ecx), after checking that r9 (the end offset) is within buflen.
+static void emit_load(Assembler* a, int size, bool msh) {
+    // cmp r9, r10; ja exit
+    a->emit({ 0x4d, 0x39, 0xd1 });
+    a->jump_if(ABOVE, a->exit());
+
+    if (msh) {
+        // movzx ecx, byte [rdi+r8]; and ecx, 0xf; shl ecx, 2
+        a->emit({ 0x42, 0x0f, 0xb6, 0x0c, 0x07,
+                  0x83, 0xe1, 0x0f,
+                  0xc1, 0xe1, 0x02 });
+    } else if (size == 4) {
+        // mov eax, [rdi+r8]; bswap eax
+        a->emit({ 0x42, 0x8b, 0x04, 0x07, 0x0f, 0xc8 });
+    } else if (size == 2) {
+        // movzx eax, word [rdi+r8]; rol ax, 8
+        a->emit({ 0x42, 0x0f, 0xb7, 0x04, 0x07, 0x66, 0xc1, 0xc0, 0x08 });
+    } else {
+        // movzx eax, byte [rdi+r8]
+        a->emit({ 0x42, 0x0f, 0xb6, 0x04, 0x07 });
+    }
+}
+
+// Set r8 to the constant offset k, and r9 to k + size (as 64 bit
+// values, so nothing can overflow).
+static void emit_abs_offset(Assembler* a, uint32_t k, int size) {
+    // mov r8d, k; lea r9, [r8+size]
+    a->emit({ 0x41, 0xb8 });
+    a->emit32(k);
+    a->emit({ 0x4d, 0x8d, 0x48, static_cast<uint8_t>(size) });
+}
+
+static int load_size(uint16_t code) {
+    switch (BPF_SIZE(code)) {
+    case BPF_W: return 4;
+    case BPF_H: return 2;
+    case BPF_B: return 1;
+    }
+    return 0;
+}
+
+// The ALU operations with a "/digit" form of opcode 0x81 (op r/m32,
+// imm32), and the matching "op r/m32, r32" opcode.
+static bool simple_alu_op(uint16_t op, uint8_t* digit, uint8_t* opcode) {
+    switch (op) {
+    case BPF_ADD: *digit = 0; *opcode = 0x01; return true;
+    case BPF_OR:  *digit = 1; *opcode = 0x09; return true;
+    case BPF_AND: *digit = 4; *opcode = 0x21; return true;
+    case BPF_SUB: *digit = 5; *opcode = 0x29; return true;
+    case BPF_XOR: *digit = 6; *opcode = 0x31; return true;
+    }
+    return false;
+}
+
+static bool emit_alu(Assembler* a, const struct bpf_insn& insn) {
+    uint16_t op = BPF_OP(insn.code);
+    bool x = BPF_SRC(insn.code) == BPF_X;
+    uint8_t digit, opcode;
+
+    if (simple_alu_op(op, &digit, &opcode)) {
+        if (x) {
+            // op eax, ecx
+            a->emit({ opcode, 0xc8 });
+        } else {
+            // op eax, imm32
+            a->emit({ 0x81, static_cast<uint8_t>(0xc0 | digit << 3) });
+            a->emit32(insn.k);
+        }
+        return true;
+    }
+
+    switch (op) {
+    case BPF_MUL:
+        if (x) {
+            // imul eax, ecx
+            a->emit({ 0x0f, 0xaf, 0xc1 });
+        } else {
+            // imul eax, eax, imm32
+            a->emit({ 0x69, 0xc0 });
+            a->emit32(insn.k);
+        }
+        return true;
+
+    case BPF_DIV:
+    case BPF_MOD:
+        if (x) {
+            // Division by zero makes the filter return 0.
+            // test ecx, ecx; jz exit; xor edx, edx; div ecx
+            a->emit({ 0x85, 0xc9 });
+            a->jump_if(EQUAL, a->exit());
+            a->emit({ 0x31, 0xd2, 0xf7, 0xf1 });
+        } else {
+            if (insn.k == 0) {
+                // Rejected by bpf_validate(); leave it to the
+                // interpreter.
+                return false;
+            }
+            // xor edx, edx; mov r9d, k; div r9d
+            a->emit({ 0x31, 0xd2, 0x41, 0xb9 });
+            a->emit32(insn.k);
+            a->emit({ 0x41, 0xf7, 0xf1 });
+        }
+        if (op == BPF_MOD) {
+            // mov eax, edx
+            a->emit({ 0x89, 0xd0 });
+        }
+        return true;
+
+    case BPF_LSH:
+    case BPF_RSH: {
+        uint8_t modrm = op == BPF_LSH ? 0xe0 : 0xe8;
+        if (x) {
+            // Shifting by 32 or more clears A, as in the interpreter.
+            // cmp ecx, 32; jae zero; shl/shr eax, cl; jmp done;
+            // zero: xor eax, eax; done:
+            a->emit({ 0x83, 0xf9, 0x20,
+                      0x73, 0x04,
+                      0xd3, modrm,
+                      0xeb, 0x02,
+                      0x31, 0xc0 });
+        } else {
+            if (insn.k >= 32) {
+                return false;
+            }
+            // shl/shr eax, imm8
+            a->emit({ 0xc1, modrm, static_cast<uint8_t>(insn.k) });
+        }
+        return true;
+    }
+
+    case BPF_NEG:
+        // neg eax
+        a->emit({ 0xf7, 0xd8 });
+        return true;
+    }
+
+    return false;
+}
+
+static bool emit_jump(Assembler* a, const struct bpf_insn& insn,
+                      size_t pc, size_t count) {
+    uint16_t op = BPF_OP(insn.code);
+    if (op == BPF_JA) {
+        if (insn.k >= count - pc - 1) {
+            return false;
+        }
+        a->jump(pc + 1 + insn.k);
+        return true;
+    }
+
+    size_t jt = pc + 1 + insn.jt;
+    size_t jf = pc + 1 + insn.jf;
+    if (jt >= count || jf >= count) {
+        return false;
+    }
+
+    bool x = BPF_SRC(insn.code) == BPF_X;
+    Condition taken;
+    Condition not_taken;
+    switch (op) {
+    case BPF_JEQ:
+        taken = EQUAL;
+        not_taken = NOT_EQUAL;
+        break;
+    case BPF_JGT:
+        taken = ABOVE;
+        not_taken = BELOW_OR_EQUAL;
+        break;
+    case BPF_JGE:
+        taken = ABOVE_OR_EQUAL;
+        not_taken = BELOW;
+        break;
+    case BPF_JSET:
+        taken = NOT_EQUAL;
+        not_taken = EQUAL;
+        break;
+    default:
+        return false;
+    }
+
+    if (op == BPF_JSET) {
+        if (x) {
+            // test eax, ecx
+            a->emit({ 0x85, 0xc8 });
+        } else {
+            // test eax, imm32
+            a->emit({ 0xa9 });
+            a->emit32(insn.k);
+        }
+    } else {
+        if (x) {
+            // cmp eax, ecx
+            a->emit({ 0x39, 0xc8 });
+        } else {
+            // cmp eax, imm32
+            a->emit({ 0x81, 0xf8 });
+            a->emit32(insn.k);
+        }
+    }
+
+    if (jt == jf) {
+        if (jt != pc + 1) {
+            a->jump(jt);
+        }
+    } else if (jt == pc + 1) {
+        a->jump_if(not_taken, jf);
+    } else {
+        a->jump_if(taken, jt);
+        if (jf != pc + 1) {
+            a->jump(jf);
+        }
+    }
+    return true;
+}
+
+static bool emit_insn(Assembler* a, const struct bpf_insn& insn,
+                      size_t pc, size_t count) {
+    uint16_t code = insn.code;
+
+    switch (BPF_CLASS(code)) {
+    case BPF_LD:
+    case BPF_LDX: {
+        bool ldx = BPF_CLASS(code) == BPF_LDX;
+        int size = load_size(code);
+        switch (BPF_MODE(code)) {
+        case BPF_IMM:
+            // mov eax/ecx, imm32
+            a->emit({ static_cast<uint8_t>(ldx ? 0xb9 : 0xb8) });
+            a->emit32(insn.k);
+            return true;
+        case BPF_LEN:
+            // mov eax/ecx, esi
+            a->emit({ 0x89, static_cast<uint8_t>(ldx ? 0xf1 : 0xf0) });
+            return true;
+        case BPF_MEM:
+            if (insn.k >= BPF_MEMWORDS) {
+                return false;
+            }
+            // mov eax/ecx, [rsp+offset]
+            a->emit({ 0x8b, static_cast<uint8_t>(ldx ? 0x4c : 0x44), 0x24,
+                      mem_offset(insn.k) });
+            return true;
+        case BPF_ABS:
+            if (ldx || size == 0) {
+                return false;
+            }
+            emit_abs_offset(a, insn.k, size);
+            emit_load(a, size, false);
+            return true;
+        case BPF_IND:
+            if (ldx || size == 0) {
+                return false;
+            }
+            // mov r8d, ecx; mov r9d, k; add r8, r9; lea r9, [r8+size]
+            a->emit({ 0x41, 0x89, 0xc8, 0x41, 0xb9 });
+            a->emit32(insn.k);
+            a->emit({ 0x4d, 0x01, 0xc8,
+                      0x4d, 0x8d, 0x48, static_cast<uint8_t>(size) });
+            emit_load(a, size, false);
+            return true;
+        case BPF_MSH:
+            if (!ldx || BPF_SIZE(code) != BPF_B) {
+                return false;
+            }
+            emit_abs_offset(a, insn.k, 1);
+            emit_load(a, 1, true);
+            return true;
+        }
+        return false;
+    }
+
+    case BPF_ST:
+    case BPF_STX:
+        if (insn.k >= BPF_MEMWORDS) {
+            return false;
+        }
+        // mov [rsp+offset], eax/ecx
+        a->emit({ 0x89,
+                  static_cast<uint8_t>(BPF_CLASS(code) == BPF_STX ?
+                                       0x4c : 0x44),
+                  0x24, mem_offset(insn.k) });
+        return true;
+
+    case BPF_ALU:
+        return emit_alu(a, insn);
+
+    case BPF_JMP:
+        return emit_jump(a, insn, pc, count);
+
+    case BPF_RET:
+        if (BPF_RVAL(code) == BPF_K) {
+            // mov eax, imm32
+            a->emit({ 0xb8 });
+            a->emit32(insn.k);
+        } else if (BPF_RVAL(code) != BPF_A) {
+            return false;
+        }
+        // ret
+        a->emit({ 0xc3 });
+        return true;
+
+    case BPF_MISC:
+        if (BPF_MISCOP(code) == BPF_TAX) {
+            // mov ecx, eax
+            a->emit({ 0x89, 0xc1 });
+        } else if (BPF_MISCOP(code) == BPF_TXA) {
+            // mov eax, ecx
+            a->emit({ 0x89, 0xc8 });
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+std::unique_ptr<BpfJit> BpfJit::compile(const struct bpf_program* program) {
+    size_t count = program->bf_len;
+    const struct bpf_insn* insns = program->bf_insns;
+    // Jumps only go forward, so a program ending in a return can't run
+    // off its end.
+    if (count == 0 || BPF_CLASS(insns[count - 1].code) != BPF_RET) {
+        return NULL;
+    }
+
+    Assembler a(count);
+    // mov r10d, edx; xor eax, eax; xor ecx, ecx
+    a.emit({ 0x41, 0x89, 0xd2, 0x31, 0xc0, 0x31, 0xc9 });
+    // The interpreter doesn't initialize M[]; start the words the
+    // program reads from zero rather than from whatever is on the
+    // stack.
+    bool zeroed[BPF_MEMWORDS] = { false };
+    for (size_t pc = 0; pc < count; ++pc) {
+        uint16_t code = insns[pc].code;
+        uint32_t k = insns[pc].k;
+        if ((BPF_CLASS(code) == BPF_LD || BPF_CLASS(code) == BPF_LDX) &&
+            BPF_MODE(code) == BPF_MEM && k < BPF_MEMWORDS && !zeroed[k]) {
+            // mov dword [rsp+offset], 0
+            a.emit({ 0xc7, 0x44, 0x24, mem_offset(k) });
+            a.emit32(0);
+            zeroed[k] = true;
+        }
+    }
+
+    for (size_t pc = 0; pc < count; ++pc) {
+        a.label(pc);
+        if (!known_opcode(insns[pc].code) ||
+            !emit_insn(&a, insns[pc], pc, count)) {
+            return NULL;
+        }
+    }
+
+    // Failed loads and divisions by zero end up here.
+    a.label(count);
+    // xor eax, eax; ret
+    a.emit({ 0x31, 0xc0, 0xc3 });
+    a.finish();
+
+    const std::vector<uint8_t>& code = a.code();
+    void* mem = mmap(NULL, code.size(), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        warn_with_errno("mmap");
+        return NULL;
+    }
+    memcpy(mem, &code[0], code.size());
+    if (mprotect(mem, code.size(), PROT_READ | PROT_EXEC) < 0) {
+        warn_with_errno("mprotect");
+        munmap(mem, code.size());
+        return NULL;
+    }
+
+    return std::unique_ptr<BpfJit>(new BpfJit(mem, code.size()));
+}
+
+#else
+
+std::unique_ptr<BpfJit> BpfJit::compile(const struct bpf_program* program) {
+    return NULL;
+}
+
+#endif
+
+BpfJit::BpfJit(void* code, size_t size)
+    : code_(code),
+      size_(size),
+      function_(reinterpret_cast<Function>(code)) {
+}
+
+BpfJit::~BpfJit() {
+    munmap(code_, size_);
+}
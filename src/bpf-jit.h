@@ -0,0 +1,47 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+// Translates classic BPF filter programs to x86-64 machine code, so
+// that matching a packet is a function call instead of a run of the
+// libpcap interpreter.
+
+#ifndef _BPF_JIT_H_
+#define _BPF_JIT_H_
+
+#include <cstddef>
+#include <memory>
+#include <pcap.h>
+#include <pcap-bpf.h>
+
+#include "base.h"
+
+class BpfJit {
+public:
+    // Compile a program. Return NULL if the program uses anything the
+    // compiler doesn't handle (or can't be proven to end in a return),
+    // or if this isn't an x86-64 machine; the interpreter has to be
+    // used for it instead.
+    static std::unique_ptr<BpfJit> compile(const struct bpf_program* program);
+    ~BpfJit();
+
+    // Run the program, with the same result as bpf_filter().
+    u_int run(const u_char* packet, u_int wirelen, u_int buflen) const {
+        return function_(packet, wirelen, buflen);
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(BpfJit);
+
+    typedef u_int (*Function)(const u_char* packet, u_int wirelen,
+                              u_int buflen);
+
+    BpfJit(void* code, size_t size);
+
+    void* code_;
+    size_t size_;
+    Function function_;
+};
+
+#endif // _BPF_JIT_H_
@@ -5,15 +5,23 @@
 
 #include "bpf.h"
 
+#include <google/gflags.h>
 #include <stdlib.h>
 
 #include "log.h"
 #include "packet.h"
 
+DECLARE_bool(bpf_jit);
+DECLARE_bool(verify_bpf_jit);
+
 PacketFilter::PacketFilter(const std::string& filter)
-    : valid_(false) {
+    : filter_(filter),
+      valid_(false) {
     memset(&program_, 0, sizeof(program_));
 
+    // Older versions of libpcap's filter compiler aren't thread-safe.
+    // That's fine, since filters are only compiled by ConfigLoader, one
+    // load at a time.
     pcap_t *p = pcap_open_dead(DLT_EN10MB, PKT_IP_MAX_SIZE);
     if (pcap_compile(p,
                      &program_,
@@ -28,6 +36,13 @@ PacketFilter::PacketFilter(const std::string& filter)
     }
 
     pcap_close(p);
+
+    if (valid_ && FLAGS_bpf_jit) {
+        jit_ = BpfJit::compile(&program_);
+        if (!jit_) {
+            info("Filter '%s' is run by the interpreter", filter.c_str());
+        }
+    }
 }
 
 PacketFilter::~PacketFilter() {
@@ -41,6 +56,20 @@ bool PacketFilter::is_valid() const {
 }
 
 bool PacketFilter::packet_matches_filter(const Packet* p) const {
-    return bpf_filter(program_.bf_insns,
-                      (const u_char *) p->ethh_, p->length_, p->length_);
+    const u_char* packet = reinterpret_cast<const u_char*>(p->ethh_);
+    if (!jit_) {
+        return bpf_filter(program_.bf_insns, packet, p->length_, p->length_);
+    }
+
+    u_int result = jit_->run(packet, p->length_, p->length_);
+    if (FLAGS_verify_bpf_jit) {
+        u_int expected = bpf_filter(program_.bf_insns, packet, p->length_,
+                                    p->length_);
+        if (result != expected) {
+            warn("Native code for filter '%s' returned %u, the interpreter %u",
+                 filter_.c_str(), result, expected);
+            return expected;
+        }
+    }
+    return result;
 }
@@ -6,16 +6,18 @@
 #ifndef _TECLO_BPF_H_
 #define _TECLO_BPF_H_
 
+#include <memory>
 #include <pcap.h>
 #include <pcap-bpf.h>
 #include <string>
 
 #include "base.h"
+#include "bpf-jit.h"
 #include "packet.h"
 
 // A wrapper class for pcap filters. Takes a filter expression and
-// compiles it, and can then be used for matching packets against the
-// compiled expression.
+// compiles it (to native code with --bpf_jit, when possible), and can
+// then be used for matching packets against the compiled expression.
 class PacketFilter {
 public:
     explicit PacketFilter(const std::string& filter);
@@ -25,12 +27,17 @@ public:
     bool is_valid() const;
     // Does this packet match the filter expression?
     bool packet_matches_filter(const Packet* p) const;
+    // The compiled BPF program.
+    const struct bpf_program* program() const { return &program_; }
 
 private:
     DISALLOW_COPY_AND_ASSIGN(PacketFilter);
 
+    const std::string filter_;
     struct bpf_program program_;
     bool valid_;
+    // NULL if the program is run by the interpreter.
+    std::unique_ptr<BpfJit> jit_;
 };
 
 #endif /* _TECLO_BPF_H_ */
@@ -0,0 +1,429 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#include "classifier.h"
+
+#include <cassert>
+#include <google/gflags.h>
+#include <string.h>
+
+#include "config.h"
+#include "log.h"
+
+DEFINE_int32(classification_cache_size, 65536,
+             "Maximum number of cached profile lookups (0 to disable)");
+DEFINE_bool(verify_classifier_index, false,
+            "Check each filter index lookup against the filters (slow)");
+
+// A range of bytes in a packet.
+struct ByteRange {
+    uint32_t offset;
+    uint32_t length;
+};
+
+// The key fields for IPv4, as offsets from the start of the ethernet
+// header: ethertype, IP version and header length, flags and fragment
+// offset, protocol, addresses.
+static const ByteRange kIpv4Ranges[] = {
+    { 12, 3 }, { 20, 2 }, { 23, 1 }, { 26, 8 },
+};
+// ... and as offsets from the end of the IPv4 header (which is how BPF
+// indexes TCP header fields): ports, flags.
+static const ByteRange kIpv4TcpRanges[] = {
+    { 14, 4 }, { 27, 1 },
+};
+// The key fields for IPv6: ethertype, next header, addresses, ports
+// (assuming no extension headers), flags.
+static const ByteRange kIpv6Ranges[] = {
+    { 12, 2 }, { 20, 1 }, { 22, 36 }, { 67, 1 },
+};
+
+template<size_t N>
+static bool covered(const ByteRange (&ranges)[N],
+                    uint64_t offset, uint64_t length) {
+    for (uint64_t i = offset; i < offset + length; ++i) {
+        bool found = false;
+        for (auto range : ranges) {
+            if (i >= range.offset && i < range.offset + range.length) {
+                found = true;
+            }
+        }
+        if (!found) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+template<size_t N>
+static void copy_ranges(const ByteRange (&ranges)[N], const uint8_t* base,
+                        ClassificationKey* key, size_t* pos) {
+    for (auto range : ranges) {
+        memcpy(key->bytes + *pos, base + range.offset, range.length);
+        *pos += range.length;
+    }
+}
+
+// Static analysis of BPF programs, to check whether a program only
+// reads the key fields. The analysis tracks just enough about the
+// register values to follow the ethertype checks and the IPv4 header
+// length computations that pcap generates.
+
+enum AnalysisValue {
+    VALUE_UNKNOWN,
+    // The ethertype, loaded from offset 12.
+    VALUE_ETHERTYPE,
+    // The IPv4 header length, as loaded by "ldxb 4*([14]&0xf)".
+    VALUE_IP_HEADER_LENGTH,
+};
+
+// What we know about the ethertype of the packet at some point of the
+// program. Only IPv4 and IPv6 packets are classified via the cache, so
+// code only reachable for other ethertypes can read anything.
+enum {
+    MAYBE_IPV4 = 1,
+    MAYBE_IPV6 = 2,
+};
+
+struct AnalysisState {
+    AnalysisState()
+        : reached(false),
+          ethertypes(MAYBE_IPV4 | MAYBE_IPV6),
+          a(VALUE_UNKNOWN),
+          x(VALUE_UNKNOWN) {
+        for (auto& value : mem) {
+            value = VALUE_UNKNOWN;
+        }
+    }
+
+    bool reached;
+    int ethertypes;
+    AnalysisValue a;
+    AnalysisValue x;
+    AnalysisValue mem[BPF_MEMWORDS];
+};
+
+static AnalysisValue merge_value(AnalysisValue a, AnalysisValue b) {
+    return a == b ? a : VALUE_UNKNOWN;
+}
+
+// Merge the state "from" into the state of instruction "target". Return
+// false if the target is out of bounds.
+static bool propagate(std::vector<AnalysisState>* states, size_t target,
+                      const AnalysisState& from) {
+    if (target >= states->size()) {
+        return false;
+    }
+
+    AnalysisState* into = &(*states)[target];
+    if (!into->reached) {
+        *into = from;
+        into->reached = true;
+        return true;
+    }
+
+    into->ethertypes |= from.ethertypes;
+    into->a = merge_value(into->a, from.a);
+    into->x = merge_value(into->x, from.x);
+    for (int i = 0; i < BPF_MEMWORDS; ++i) {
+        into->mem[i] = merge_value(into->mem[i], from.mem[i]);
+    }
+
+    return true;
+}
+
+static uint32_t load_size(uint16_t code) {
+    switch (BPF_SIZE(code)) {
+    case BPF_W:
+        return 4;
+    case BPF_H:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+// Is an absolute load of these bytes within the key, for all of the
+// possible ethertypes?
+static bool absolute_load_in_key(int ethertypes,
+                                 uint32_t offset, uint32_t size) {
+    if ((ethertypes & MAYBE_IPV4) && !covered(kIpv4Ranges, offset, size)) {
+        return false;
+    }
+    if ((ethertypes & MAYBE_IPV6) && !covered(kIpv6Ranges, offset, size)) {
+        return false;
+    }
+    return true;
+}
+
+static bool filter_reads_only_key(const struct bpf_program* program) {
+    std::vector<AnalysisState> states(program->bf_len);
+
+    if (states.empty()) {
+        return true;
+    }
+    states[0].reached = true;
+
+    for (size_t i = 0; i < states.size(); ++i) {
+        if (!states[i].reached) {
+            continue;
+        }
+
+        AnalysisState s = states[i];
+        const struct bpf_insn& insn = program->bf_insns[i];
+        // Only the code reachable by IP packets matters.
+        bool live = s.ethertypes != 0;
+
+        switch (BPF_CLASS(insn.code)) {
+        case BPF_LD:
+            switch (BPF_MODE(insn.code)) {
+            case BPF_ABS:
+                if (live && !absolute_load_in_key(s.ethertypes, insn.k,
+                                                  load_size(insn.code))) {
+                    return false;
+                }
+                s.a = (insn.k == 12 && BPF_SIZE(insn.code) == BPF_H) ?
+                    VALUE_ETHERTYPE : VALUE_UNKNOWN;
+                break;
+            case BPF_IND:
+                if (live && (s.x != VALUE_IP_HEADER_LENGTH ||
+                             s.ethertypes != MAYBE_IPV4 ||
+                             !covered(kIpv4TcpRanges, insn.k,
+                                      load_size(insn.code)))) {
+                    return false;
+                }
+                s.a = VALUE_UNKNOWN;
+                break;
+            case BPF_MEM:
+                if (insn.k >= BPF_MEMWORDS) {
+                    return false;
+                }
+                s.a = s.mem[insn.k];
+                break;
+            case BPF_IMM:
+                s.a = VALUE_UNKNOWN;
+                break;
+            default:
+                // Packet length, or something we don't understand.
+                if (live) {
+                    return false;
+                }
+                s.a = VALUE_UNKNOWN;
+                break;
+            }
+            break;
+
+        case BPF_LDX:
+            switch (BPF_MODE(insn.code)) {
+            case BPF_MSH:
+                if (live && !absolute_load_in_key(s.ethertypes, insn.k, 1)) {
+                    return false;
+                }
+                s.x = insn.k == 14 ? VALUE_IP_HEADER_LENGTH : VALUE_UNKNOWN;
+                break;
+            case BPF_MEM:
+                if (insn.k >= BPF_MEMWORDS) {
+                    return false;
+                }
+                s.x = s.mem[insn.k];
+                break;
+            case BPF_IMM:
+                s.x = VALUE_UNKNOWN;
+                break;
+            default:
+                if (live) {
+                    return false;
+                }
+                s.x = VALUE_UNKNOWN;
+                break;
+            }
+            break;
+
+        case BPF_ST:
+        case BPF_STX:
+            if (insn.k >= BPF_MEMWORDS) {
+                return false;
+            }
+            s.mem[insn.k] = BPF_CLASS(insn.code) == BPF_ST ? s.a : s.x;
+            break;
+
+        case BPF_ALU:
+            s.a = VALUE_UNKNOWN;
+            break;
+
+        case BPF_MISC:
+            if (BPF_MISCOP(insn.code) == BPF_TAX) {
+                s.x = s.a;
+            } else {
+                s.a = s.x;
+            }
+            break;
+
+        case BPF_RET:
+            continue;
+
+        case BPF_JMP: {
+            if (BPF_OP(insn.code) == BPF_JA) {
+                if (!propagate(&states, i + 1 + insn.k, s)) {
+                    return false;
+                }
+                continue;
+            }
+
+            AnalysisState taken = s;
+            AnalysisState not_taken = s;
+            if (BPF_OP(insn.code) == BPF_JEQ &&
+                BPF_SRC(insn.code) == BPF_K &&
+                s.a == VALUE_ETHERTYPE) {
+                int ethertype = 0;
+                if (insn.k == PKT_ETHER_TYPE_IP) {
+                    ethertype = MAYBE_IPV4;
+                } else if (insn.k == PKT_ETHER_TYPE_IPV6) {
+                    ethertype = MAYBE_IPV6;
+                }
+                taken.ethertypes &= ethertype;
+                not_taken.ethertypes &= ~ethertype;
+            }
+
+            if (!propagate(&states, i + 1 + insn.jt, taken) ||
+                !propagate(&states, i + 1 + insn.jf, not_taken)) {
+                return false;
+            }
+            continue;
+        }
+        }
+
+        if (!propagate(&states, i + 1, s)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+Classifier::Classifier()
+    : cacheable_profiles_(0),
+      cache_hits_(0),
+      cache_misses_(0),
+      index_fallbacks_(0),
+      index_mismatches_(0) {
+}
+
+void Classifier::update(const std::vector<Profile*>& profiles,
+                        std::shared_ptr<const FilterIndex> index) {
+    assert(!index || index->size() == profiles.size());
+    profiles_ = profiles;
+    index_ = index;
+    cache_.clear();
+
+    cacheable_profiles_ = 0;
+    while (cacheable_profiles_ < profiles_.size() &&
+           profiles_[cacheable_profiles_]->compiled()->cacheable()) {
+        ++cacheable_profiles_;
+    }
+}
+
+bool Classifier::is_cacheable(const struct bpf_program* program) {
+    return filter_reads_only_key(program);
+}
+
+bool Classifier::make_key(const Packet* p, ClassificationKey* key) {
+    const uint8_t* frame = reinterpret_cast<const uint8_t*>(p->ethh_);
+    size_t pos = 0;
+
+    memset(key, 0, sizeof(*key));
+
+    if (p->length_ < PKT_ETHER_HEADER_LEN + 1) {
+        return false;
+    }
+
+    uint16_t ethertype = ntohs(p->ethh_->h_proto);
+    if (ethertype == PKT_ETHER_TYPE_IP) {
+        uint32_t header_length = 4 * (frame[PKT_ETHER_HEADER_LEN] & 0xf);
+        if (p->length_ < header_length + 28 ||
+            p->length_ < 34) {
+            return false;
+        }
+        copy_ranges(kIpv4Ranges, frame, key, &pos);
+        copy_ranges(kIpv4TcpRanges, frame + header_length, key, &pos);
+        return true;
+    } else if (ethertype == PKT_ETHER_TYPE_IPV6) {
+        if (p->length_ < 68) {
+            return false;
+        }
+        copy_ranges(kIpv6Ranges, frame, key, &pos);
+        return true;
+    }
+
+    return false;
+}
+
+size_t Classifier::match(const Packet* p, size_t begin, size_t end) {
+    if (!index_ || !index_->candidates(p, &candidates_)) {
+        ++index_fallbacks_;
+        return match_filters(p, begin, end);
+    }
+
+    size_t i = FilterIndex::next(candidates_, begin, end);
+    while (i < end && !index_->exact(i) &&
+           !profiles_[i]->filter()->packet_matches_filter(p)) {
+        i = FilterIndex::next(candidates_, i + 1, end);
+    }
+
+    if (FLAGS_verify_classifier_index) {
+        size_t expected = match_filters(p, begin, end);
+        if (i != expected) {
+            ++index_mismatches_;
+            warn("Filter index matched profile '%s', filters matched '%s'",
+                 i < end ? profiles_[i]->profile_config().id().c_str() : "",
+                 expected < end ?
+                     profiles_[expected]->profile_config().id().c_str() : "");
+            return expected;
+        }
+    }
+    return i;
+}
+
+size_t Classifier::match_filters(const Packet* p, size_t begin,
+                                 size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+        if (profiles_[i]->filter()->packet_matches_filter(p)) {
+            return i;
+        }
+    }
+
+    return end;
+}
+
+Profile* Classifier::classify(const Packet* p) {
+    // Where to start matching the remaining profiles from.
+    size_t index = 0;
+
+    ClassificationKey key;
+    if (cacheable_profiles_ && FLAGS_classification_cache_size > 0 &&
+        make_key(p, &key)) {
+        auto it = cache_.find(key);
+        if (it != cache_.end()) {
+            ++cache_hits_;
+            index = it->second;
+        } else {
+            ++cache_misses_;
+            index = match(p, 0, cacheable_profiles_);
+            if (cache_.size() >=
+                static_cast<size_t>(FLAGS_classification_cache_size)) {
+                cache_.clear();
+            }
+            cache_[key] = index;
+        }
+
+        if (index < cacheable_profiles_) {
+            return profiles_[index];
+        }
+    }
+
+    index = match(p, index, profiles_.size());
+    return index < profiles_.size() ? profiles_[index] : NULL;
+}
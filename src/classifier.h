@@ -0,0 +1,95 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#ifndef _CLASSIFIER_H_
+#define _CLASSIFIER_H_
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "base.h"
+#include "connection-table.h"
+#include "filter-index.h"
+#include "packet.h"
+
+class Profile;
+struct bpf_program;
+
+// The packet bytes that a profile filter may look at for its result
+// to be cacheable: ethertype, IP addresses, protocol and fragment
+// fields, TCP ports and flags. Unused bytes are zero.
+struct ClassificationKey {
+    uint8_t bytes[40];
+};
+
+// Finds the highest priority profile matching a SYN. The candidate
+// profiles are looked up in the filter index, so only the filters it
+// couldn't index are run. The results are cached by the packet fields
+// the filters read, as long as the filters don't read anything else.
+class Classifier {
+public:
+    Classifier();
+
+    // Start using this list of profiles (ordered by priority) and the
+    // index over their filters (NULL to run all the filters), and
+    // invalidate the cache.
+    void update(const std::vector<Profile*>& profiles,
+                std::shared_ptr<const FilterIndex> index);
+
+    // The first profile in priority order whose filter matches this
+    // packet, or NULL if there is none.
+    Profile* classify(const Packet* p);
+
+    // True if a filter program only reads the key fields, so that its
+    // result can be cached.
+    static bool is_cacheable(const struct bpf_program* program);
+
+    uint64_t cache_hits() const { return cache_hits_; }
+    uint64_t cache_misses() const { return cache_misses_; }
+    size_t cache_size() const { return cache_.size(); }
+    // Packets the index couldn't be used for.
+    uint64_t index_fallbacks() const { return index_fallbacks_; }
+    // With --verify_classifier_index, the packets for which the index
+    // and the filters disagreed.
+    uint64_t index_mismatches() const { return index_mismatches_; }
+    // Profiles whose filters couldn't be indexed.
+    size_t residual_profiles() const {
+        return index_ ? index_->residual() : profiles_.size();
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(Classifier);
+
+    // Fill in the cache key for this packet. Return false if the packet
+    // can't be cached (not IP, or too short).
+    static bool make_key(const Packet* p, ClassificationKey* key);
+    // Index of the first profile in [begin, end) matching the packet,
+    // or end if there is none.
+    size_t match(const Packet* p, size_t begin, size_t end);
+    // The same, running every filter.
+    size_t match_filters(const Packet* p, size_t begin, size_t end);
+
+    std::vector<Profile*> profiles_;
+    std::shared_ptr<const FilterIndex> index_;
+    // Scratch space for the index lookups.
+    FilterIndex::Bitmap candidates_;
+    // Number of profiles at the start of profiles_ whose filters only
+    // look at the key fields. Any match in this prefix can be cached.
+    size_t cacheable_profiles_;
+
+    // Index of the first matching profile in the cacheable prefix, or
+    // cacheable_profiles_ if none of them matched.
+    std::map<ClassificationKey, size_t,
+             ConnectionKeyComparator<ClassificationKey> > cache_;
+
+    uint64_t cache_hits_;
+    uint64_t cache_misses_;
+    uint64_t index_fallbacks_;
+    uint64_t index_mismatches_;
+};
+
+#endif // _CLASSIFIER_H_
@@ -0,0 +1,64 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#include "config-loader.h"
+
+#include "log.h"
+
+ConfigLoader::ConfigLoader(const std::string& filename, int shards,
+                           const Publish& publish)
+    : filename_(filename),
+      shards_(shards),
+      publish_(publish),
+      requested_(false),
+      stopping_(false),
+      thread_([this] () { run(); }) {
+}
+
+ConfigLoader::~ConfigLoader() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wakeup_.notify_one();
+    thread_.join();
+}
+
+std::shared_ptr<const ConfigSnapshot> ConfigLoader::load() {
+    if (filename_.empty()) {
+        return std::shared_ptr<const ConfigSnapshot>(new ConfigSnapshot());
+    }
+    info("Loading configuration from %s", filename_.c_str());
+    return ConfigSnapshot::load(filename_, shards_);
+}
+
+void ConfigLoader::request() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        requested_ = true;
+    }
+    wakeup_.notify_one();
+}
+
+void ConfigLoader::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while (true) {
+        wakeup_.wait(lock, [this] () { return requested_ || stopping_; });
+        if (stopping_) {
+            return;
+        }
+        requested_ = false;
+
+        lock.unlock();
+        std::shared_ptr<const ConfigSnapshot> snapshot = load();
+        if (snapshot) {
+            publish_(snapshot);
+        } else {
+            warn("Failed to reload configuration, keeping the old one");
+        }
+        lock.lock();
+    }
+}
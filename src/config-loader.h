@@ -0,0 +1,57 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#ifndef _CONFIG_LOADER_H_
+#define _CONFIG_LOADER_H_
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "base.h"
+#include "config.h"
+
+// Loads the configuration file on a thread of its own, so that parsing
+// it and compiling the filters never holds up the event loops. Each
+// successfully loaded snapshot is handed to a callback (on the loader
+// thread) for publishing to the workers.
+class ConfigLoader {
+public:
+    typedef std::function<void(std::shared_ptr<const ConfigSnapshot>)>
+        Publish;
+
+    ConfigLoader(const std::string& filename, int shards,
+                 const Publish& publish);
+    ~ConfigLoader();
+
+    // Load the configuration right away, in this thread. Return NULL on
+    // error. Must not be called after request(), since a background
+    // load could then be compiling filters at the same time.
+    std::shared_ptr<const ConfigSnapshot> load();
+
+    // Reload the configuration in the background. Requests arriving
+    // while a load is in progress are merged into one more load.
+    void request();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ConfigLoader);
+
+    void run();
+
+    const std::string filename_;
+    const int shards_;
+    Publish publish_;
+
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    bool requested_;
+    bool stopping_;
+    std::thread thread_;
+};
+
+#endif // _CONFIG_LOADER_H_
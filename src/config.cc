@@ -12,15 +12,19 @@
 #include <sys/types.h>
 
 #include "log.h"
+#include "shared-throttler.h"
+#include "state.h"
+#include "timed-events.h"
 
-Profile::Profile(const FlowDisruptorProfile& profile) {
-    update(profile);
-}
-
-void Profile::update(const FlowDisruptorProfile& profile) {
-    profile_.CopyFrom(profile);
-
-    filter_.reset(new PacketFilter(profile_.filter()));
+CompiledProfile::CompiledProfile(const FlowDisruptorProfile& profile)
+    : profile_(profile),
+      filter_(new PacketFilter(profile.filter())),
+      cacheable_(Classifier::is_cacheable(filter_->program())),
+      predicate_(filter_->is_valid() ?
+                 FilterPredicate::parse(profile.filter()) : NULL),
+      downlink_events_(new VolumeEventSchedule(profile.downlink())),
+      uplink_events_(new VolumeEventSchedule(profile.uplink())),
+      timed_events_(new TimedEventSchedule(profile)) {
     if (!filter_->is_valid()) {
         warn("Invalid filter '%s' for profile '%s'",
              profile_.filter().c_str(),
@@ -28,40 +32,161 @@ void Profile::update(const FlowDisruptorProfile& profile) {
     }
 }
 
-bool Config::update(const std::string& filename) {
+Profile::Profile(std::shared_ptr<const CompiledProfile> compiled,
+                 Stats* stats)
+    : memory_(NULL),
+      shared_throttlers_() {
+    update(compiled);
+
+    MemoryAccount* memory = &memory_;
+    stats->add_gauge("profile." + compiled->config().id() + ".memory_bytes",
+                     [memory] () { return memory->bytes; });
+}
+
+void Profile::update(std::shared_ptr<const CompiledProfile> compiled) {
+    compiled_ = compiled;
+    const FlowDisruptorProfile& profile = compiled_->config();
+
+    profile_events_.update(profile.profile_event());
+
+    if (shared_throttlers_[IoInterface::DOWNLINK]) {
+        shared_throttlers_[IoInterface::DOWNLINK]->update(
+            profile.shared_downlink());
+    }
+    if (shared_throttlers_[IoInterface::UPLINK]) {
+        shared_throttlers_[IoInterface::UPLINK]->update(
+            profile.shared_uplink());
+    }
+}
+
+SharedThrottler* Profile::shared_throttler(State* state,
+                                           IoInterface::Direction direction) {
+    SharedThrottler*& throttler = shared_throttlers_[direction];
+    if (throttler == NULL) {
+        if (direction == IoInterface::DOWNLINK) {
+            throttler = new SharedThrottler(state, state->shared_downlink);
+            throttler->update(profile_config().shared_downlink());
+        } else {
+            throttler = new SharedThrottler(state, state->shared_uplink);
+            throttler->update(profile_config().shared_uplink());
+        }
+    }
+    return throttler;
+}
+
+// The n'th part of a limit, rounded up so that a limit never turns into
+// "unlimited".
+static uint64_t divide(uint64_t limit, int n) {
+    return (limit + n - 1) / n;
+}
+
+static void divide_admission(AdmissionLimits* limits, int n) {
+    if (limits->has_max_new_connections_per_second()) {
+        limits->set_max_new_connections_per_second(
+            limits->max_new_connections_per_second() / n);
+    }
+    if (limits->has_max_half_open_connections()) {
+        limits->set_max_half_open_connections(
+            divide(limits->max_half_open_connections(), n));
+    }
+    if (limits->has_max_connections()) {
+        limits->set_max_connections(divide(limits->max_connections(), n));
+    }
+}
+
+static void divide_shared(SharedLinkProperties* link, int n) {
+    if (link->has_throughput_kbps()) {
+        link->set_throughput_kbps(divide(link->throughput_kbps(), n));
+    }
+    if (link->has_max_queue_bytes()) {
+        link->set_max_queue_bytes(divide(link->max_queue_bytes(), n));
+    }
+}
+
+// Divide the limits on the traffic as a whole between "shards" workers.
+static void divide_limits(FlowDisruptorConfig* config, int shards) {
+    if (config->has_admission()) {
+        divide_admission(config->mutable_admission(), shards);
+    }
+    if (config->has_downlink()) {
+        divide_shared(config->mutable_downlink(), shards);
+    }
+    if (config->has_uplink()) {
+        divide_shared(config->mutable_uplink(), shards);
+    }
+    if (config->memory().has_max_bytes()) {
+        MemoryLimits* memory = config->mutable_memory();
+        memory->set_max_bytes(divide(memory->max_bytes(), shards));
+    }
+
+    for (auto& profile : *config->mutable_profile()) {
+        if (profile.has_admission()) {
+            divide_admission(profile.mutable_admission(), shards);
+        }
+        if (profile.has_shared_downlink()) {
+            divide_shared(profile.mutable_shared_downlink(), shards);
+        }
+        if (profile.has_shared_uplink()) {
+            divide_shared(profile.mutable_shared_uplink(), shards);
+        }
+    }
+}
+
+std::shared_ptr<const ConfigSnapshot> ConfigSnapshot::load(
+    const std::string& filename, int shards) {
     int fd = open(filename.c_str(), O_RDONLY);
     if (fd < 0) {
         warn_with_errno("couldn't open '%s'", filename.c_str());
-        return false;
+        return NULL;
     }
 
-    google::protobuf::io::FileInputStream stream(fd);
+    std::shared_ptr<ConfigSnapshot> snapshot(new ConfigSnapshot());
+    {
+        google::protobuf::io::FileInputStream stream(fd);
+        stream.SetCloseOnDelete(true);
+        if (!google::protobuf::TextFormat::Parse(&stream,
+                                                 &snapshot->config_)) {
+            warn("Error parsing configuration");
+            return NULL;
+        }
+    }
 
-    FlowDisruptorConfig config;
-    if (!google::protobuf::TextFormat::Parse(&stream, &config)) {
-        warn("Error parsing configuration");
-        return false;
+    if (shards > 1) {
+        divide_limits(&snapshot->config_, shards);
+    }
+    std::vector<const FilterPredicate*> predicates;
+    for (const auto& profile : snapshot->config_.profile()) {
+        snapshot->profiles_.emplace_back(new CompiledProfile(profile));
+        predicates.push_back(snapshot->profiles_.back()->predicate());
     }
+    snapshot->filter_index_.reset(new FilterIndex(predicates));
 
-    config_.CopyFrom(config);
-    update_profiles();
+    return snapshot;
+}
 
-    return true;
+Config::Config(Stats* stats)
+    : stats_(stats),
+      snapshot_(new ConfigSnapshot()) {
 }
 
-void Config::update_profiles() {
+void Config::update(std::shared_ptr<const ConfigSnapshot> snapshot) {
+    // Connections hold on to the compiled profiles they use, so the old
+    // snapshot goes away once the last of them is gone.
+    snapshot_ = snapshot;
     profiles_by_priority_.clear();
 
-    for (auto profile_config : config_.profile()) {
-        Profile* profile = profiles_by_id_[profile_config.id()];
+    for (const auto& compiled : snapshot_->profiles()) {
+        const std::string& id = compiled->config().id();
+        Profile* profile = profiles_by_id_[id];
 
         if (profile == NULL) {
-            profile = profiles_by_id_[profile_config.id()] =
-                new Profile(profile_config);
+            profile = profiles_by_id_[id] = new Profile(compiled, stats_);
         } else {
-            profile->update(profile_config);
+            profile->update(compiled);
         }
 
         profiles_by_priority_.push_back(profile);
     }
+
+    classifier_.update(profiles_by_priority_, snapshot_->filter_index());
 }
@@ -14,36 +14,167 @@
 #include <string>
 #include <vector>
 
+#include "admission.h"
+#include "base.h"
 #include "bpf.h"
+#include "classifier.h"
+#include "filter-index.h"
 #include "FlowDisruptorConfig.pb.h"
+#include "iface.h"
+#include "memory-budget.h"
 #include "packet.h"
+#include "profile-events.h"
+#include "stats.h"
+#include "volume-events.h"
 
-// A compiled traffic profile, matching some traffic as specified by a pcap
+class SharedThrottler;
+struct State;
+class TimedEventSchedule;
+
+// The immutable, compiled part of a traffic profile: the configuration,
+// the filter and the event schedules. Built off the event loop when the
+// configuration is loaded, and shared by all workers. Connections keep a
+// reference to the version they were created with.
+class CompiledProfile {
+public:
+    explicit CompiledProfile(const FlowDisruptorProfile& profile);
+
+    const FlowDisruptorProfile& config() const { return profile_; }
+    // The compiled filter for traffic this profile is supposed to match.
+    const PacketFilter* filter() const { return filter_.get(); }
+    // True if the filter only looks at fields the classifier can cache
+    // the result by.
+    bool cacheable() const { return cacheable_; }
+    // The filter as a predicate for the classifier's index, or NULL if
+    // it's not one of the simple forms.
+    const FilterPredicate* predicate() const { return predicate_.get(); }
+    std::shared_ptr<const VolumeEventSchedule> downlink_events() const {
+        return downlink_events_;
+    }
+    std::shared_ptr<const VolumeEventSchedule> uplink_events() const {
+        return uplink_events_;
+    }
+    std::shared_ptr<const TimedEventSchedule> timed_events() const {
+        return timed_events_;
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(CompiledProfile);
+
+    const FlowDisruptorProfile profile_;
+    std::unique_ptr<PacketFilter> filter_;
+    bool cacheable_;
+    std::unique_ptr<FilterPredicate> predicate_;
+    std::shared_ptr<const VolumeEventSchedule> downlink_events_;
+    std::shared_ptr<const VolumeEventSchedule> uplink_events_;
+    std::shared_ptr<const TimedEventSchedule> timed_events_;
+};
+
+// One version of the whole configuration, with all of its profiles
+// compiled. Never modified once loaded.
+class ConfigSnapshot {
+public:
+    // An empty configuration.
+    ConfigSnapshot() { }
+
+    // Parse and compile the configuration in this file, for use by one
+    // of "shards" workers that each handle an equal part of the traffic
+    // (limits on the traffic as a whole are divided between them).
+    // Return NULL on error.
+    static std::shared_ptr<const ConfigSnapshot> load(
+        const std::string& filename, int shards);
+
+    const FlowDisruptorConfig& config() const { return config_; }
+    // In configuration (= priority) order.
+    const std::vector<std::shared_ptr<const CompiledProfile> >& profiles()
+        const {
+        return profiles_;
+    }
+    // The index over the profile filters, or NULL for an empty
+    // configuration.
+    std::shared_ptr<const FilterIndex> filter_index() const {
+        return filter_index_;
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ConfigSnapshot);
+
+    FlowDisruptorConfig config_;
+    std::vector<std::shared_ptr<const CompiledProfile> > profiles_;
+    std::shared_ptr<const FilterIndex> filter_index_;
+};
+
+// A traffic profile, matching some traffic as specified by a pcap
 // filter and applying the settings as per the FlowDisruptorProfile.
+// The profile object lives as long as the program, and keeps the state
+// that must survive configuration reloads; the compiled configuration
+// is replaced on each reload.
 class Profile {
 public:
-    Profile(const FlowDisruptorProfile& profile);
+    // The profile's statistics are registered in "stats".
+    Profile(std::shared_ptr<const CompiledProfile> compiled, Stats* stats);
 
-    // Update the configuration for this profile.
-    void update(const FlowDisruptorProfile& profile);
+    // Start using a new version of the configuration for this profile.
+    void update(std::shared_ptr<const CompiledProfile> compiled);
+
+    // The current version of the configuration.
+    std::shared_ptr<const CompiledProfile> compiled() const {
+        return compiled_;
+    }
 
     // The compiled filter for traffic this profile is supposed to match.
-    const PacketFilter* filter() { return filter_.get(); }
+    const PacketFilter* filter() { return compiled_->filter(); }
     // The configuration for this profile.
-    const FlowDisruptorProfile& profile_config() const { return profile_; }
+    const FlowDisruptorProfile& profile_config() const {
+        return compiled_->config();
+    }
+    // Connection admission state for this profile.
+    ProfileAdmission* admission() { return &admission_; }
+    // The compiled volume events for each direction. Connections keep a
+    // reference, so these stay valid across configuration reloads.
+    std::shared_ptr<const VolumeEventSchedule> downlink_events() const {
+        return compiled_->downlink_events();
+    }
+    std::shared_ptr<const VolumeEventSchedule> uplink_events() const {
+        return compiled_->uplink_events();
+    }
+    // Packet memory used by connections of this profile.
+    MemoryAccount* memory() { return &memory_; }
+    // Events affecting all connections of the profile at once. Unlike
+    // the rest of the profile, the epoch is kept across reloads.
+    ProfileEvents* profile_events() { return &profile_events_; }
+    // The shared throttler for all traffic of this profile sent toward
+    // the interface with this direction. Created on first use.
+    SharedThrottler* shared_throttler(State* state,
+                                      IoInterface::Direction direction);
+    // The compiled timed events.
+    std::shared_ptr<const TimedEventSchedule> timed_events() const {
+        return compiled_->timed_events();
+    }
 
 private:
-    FlowDisruptorProfile profile_;
-    std::unique_ptr<PacketFilter> filter_;
+    std::shared_ptr<const CompiledProfile> compiled_;
+    ProfileAdmission admission_;
+    ProfileEvents profile_events_;
+    MemoryAccount memory_;
+    // Indexed by IoInterface::Direction. Owned.
+    SharedThrottler* shared_throttlers_[2];
 };
 
+// The configuration as seen by one worker. Only used from the worker's
+// own thread.
 class Config {
 public:
-    Config() {
-    }
+    // Statistics of new profiles are registered in "stats".
+    explicit Config(Stats* stats);
+
+    // Start using this version of the configuration. Cheap enough to do
+    // on the event loop: everything expensive was done when the snapshot
+    // was loaded.
+    void update(std::shared_ptr<const ConfigSnapshot> snapshot);
 
-    // Update the configuration from this filename.
-    bool update(const std::string& filename);
+    // The currently active configuration.
+    const FlowDisruptorConfig& config() const { return snapshot_->config(); }
 
     // List of profiles, ordered by priority (highest priority first). If
     // traffic matches two profiles, use the first profile in this list.
@@ -51,11 +182,18 @@ public:
         return profiles_by_priority_;
     }
 
-private:
-    void update_profiles();
+    // The highest priority profile matching this SYN, or NULL if none
+    // of them match.
+    Profile* classify(const Packet* p) {
+        return classifier_.classify(p);
+    }
+    const Classifier* classifier() const { return &classifier_; }
 
-    FlowDisruptorConfig config_;
+private:
+    Stats* stats_;
+    std::shared_ptr<const ConfigSnapshot> snapshot_;
     std::vector<Profile*> profiles_by_priority_;
+    Classifier classifier_;
     std::map<std::string, Profile*> profiles_by_id_;
 };
 
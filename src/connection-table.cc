@@ -61,13 +61,6 @@ void ConnectionTable::connection_key_for_packet(ConnectionKey* key, Packet* p) {
     }
 }
 
-template<class T>
-struct ConnectionKeyComparator {
-    bool operator() (const T& a, const T& b) const {
-        return memcmp(&a, &b, sizeof(a)) < 0;
-    }
-};
-
 class MapConnectionTable : public ConnectionTable {
 public:
     ~MapConnectionTable() {
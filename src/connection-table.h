@@ -7,6 +7,7 @@
 #define _CONNECTION_TABLE_H_
 
 #include <stdint.h>
+#include <string.h>
 #include <vector>
 
 #include "packet.h"
@@ -35,6 +36,14 @@ union ConnectionKey {
     connection_key_v6 key_v6;
 };
 
+// Ordering for using the keys in std::maps.
+template<class T>
+struct ConnectionKeyComparator {
+    bool operator() (const T& a, const T& b) const {
+        return memcmp(&a, &b, sizeof(a)) < 0;
+    }
+};
+
 class Connection;
 
 class ConnectionTable {
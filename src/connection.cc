@@ -17,25 +17,52 @@ TcpFlow::TcpFlow(State* state, Profile* profile,
                  IoInterface* iface, const std::string& id)
     : state_(state),
       iface_(iface),
-      dumper_(stringprintf("%s-%s-%s.cap",
+      memory_(profile->memory()),
+      dumper_(state->pcap_writer,
+              stringprintf("%s-%s-%s.cap",
                            iface->name().c_str(),
                            profile->profile_config().id().c_str(),
                            id.c_str())),
-      transmit_timer_(state, [this] (Timer* t) { transmit_timeout(); }),
+      packets_(state->delay_queue_pool, state->delay_line),
+      transmit_timer_(state->departures,
+                      [this] (WheelTimer* t) { transmit_timeout(); }),
       delay_s_(0),
+      fast_path_packets_(state->stats.counter("connection.fast_path_packets")),
       received_rst_(false),
       received_fin_(false),
-      throttler_(state) {
+      throttler_(state, &memory_, [this] (Packet* p, ev_tstamp released_at) {
+              if (shared_) {
+                  shared_->insert(p, released_at);
+              } else {
+                  delay_packet(p, released_at);
+              }
+          }) {
+    SharedThrottler* shared =
+        profile->shared_throttler(state, iface->direction());
+    if (shared->is_limited()) {
+        shared_.reset(new SharedThrottler::Flow(
+                          shared, &memory_,
+                          [this] (Packet* p, ev_tstamp released_at) {
+                              delay_packet(p, released_at);
+                          }));
+    }
+
     if (profile->profile_config().dump_pcap()) {
-        if (!dumper_.open()) {
+        if (!state->memory->charge(&memory_, MemoryBudget::CAPTURE_BUFFER,
+                                   PcapDumper::kBufferSize)) {
+            warn("Memory budget exceeded, not writing trace file");
+        } else if (!dumper_.open()) {
             fail("Failed to open trace file.");
         }
     }
 }
 
 TcpFlow::~TcpFlow() {
-    for (auto packet : packets_) {
-        delete packet.second;
+    state_->memory->release_queue(&memory_, MemoryBudget::DELAY_QUEUE,
+                                  packets_);
+    if (dumper_.is_open()) {
+        state_->memory->release(&memory_, MemoryBudget::CAPTURE_BUFFER,
+                                PcapDumper::kBufferSize);
     }
 }
 
@@ -62,39 +89,72 @@ void TcpFlow::record_packet_rx(Packet* p) {
     dumper_.dump_packet(p);
 }
 
+void TcpFlow::record_packet_tx(Packet* p) {
+    dumper_.dump_packet(p);
+}
+
 void TcpFlow::queue_packet_tx(Packet* p) {
-    auto callback = [&] (Packet copy) {
-        packets_.push_back(std::make_pair(ev_now(state_->loop) + delay_s_,
-                                          new Packet(copy)));
-        transmit();
-    };
+    // Fast path: no delay, nothing queued that this packet would have to
+    // wait behind, and the throttler isn't doing anything.
+    if (delay_s_ <= 0 &&
+        packets_.empty() &&
+        !shared_ &&
+        throttler_.pass_through(p)) {
+        iface_->io()->inject(p);
+        dumper_.dump_packet(p);
+        ++*fast_path_packets_;
+        return;
+    }
 
-    throttler_.insert(p->length_, std::bind(callback, *p));
+    throttler_.insert(p->detach());
 }
 
-void TcpFlow::reschedule_transmit_timer() {
-    transmit_timer_.stop();
+void TcpFlow::delay_packet(Packet* p, ev_tstamp released_at) {
+    if (!state_->memory->charge_packet(&memory_, MemoryBudget::DELAY_QUEUE, p,
+                                       [this] () { return drop_oldest(); })) {
+        delete p;
+        return;
+    }
 
-    if (!packets_.empty()) {
-        ev_tstamp delay = packets_.front().first - ev_now(state_->loop);
+    packets_.push_back(p, released_at + delay_s_);
+    transmit();
+}
+
+bool TcpFlow::drop_oldest() {
+    if (packets_.empty()) {
+        return false;
+    }
+
+    state_->memory->release_packet(&memory_, MemoryBudget::DELAY_QUEUE,
+                                   packets_.front_packet());
+    packets_.pop_front();
+    return true;
+}
+
+void TcpFlow::reschedule_transmit_timer() {
+    if (packets_.empty()) {
+        transmit_timer_.stop();
+    } else {
+        ev_tstamp delay = packets_.front().due - ev_now(state_->loop);
         transmit_timer_.reschedule(delay);
     }
 }
 
 void TcpFlow::transmit() {
     while (!packets_.empty()) {
-        ev_tstamp target = packets_.front().first;
+        ev_tstamp target = packets_.front().due;
         if (target > ev_now(state_->loop)) {
             break;
         }
 
-        Packet* p = packets_.front().second;
+        Packet* p = packets_.front_packet();
+        state_->memory->release_packet(&memory_, MemoryBudget::DELAY_QUEUE, p);
 
         iface_->io()->inject(p);
+        state_->departure_lateness->record(ev_time() - target);
         dumper_.dump_packet(p);
 
         packets_.pop_front();
-        delete p;
     }
 
     reschedule_transmit_timer();
@@ -151,22 +211,28 @@ bool TcpFlow::should_close() {
 
 bool TcpFlow::can_close() {
     if (received_rst_ ||
-        (packets_.empty() && !throttler_.has_queued_data())) {
+        (packets_.empty() && !throttler_.has_queued_data() &&
+         !(shared_ && shared_->has_queued_data()))) {
         return true;
     }
 
     return false;
 }
 
-Connection::Connection(Profile* profile, Packet* p, State* state)
+Connection::Connection(Profile* profile, Packet* p, State* state,
+                       ev_tstamp first_syn_timestamp)
     : state_(state),
       profile_(profile),
-      first_syn_timestamp_(ev_now(state_->loop)),
+      compiled_(profile->compiled()),
+      first_syn_timestamp_(first_syn_timestamp),
       connection_state_(STATE_SYN),
       id_(stringprintf("%.9lf", ev_time())),
       client_(state, profile, p->from_iface_, id_),
       server_(state, profile, p->from_iface_->other(), id_),
-      idle_timer_(state, ([this] (Timer* t) { close(); })) {
+      idle_timer_(state->timer_wheel, ([this] (WheelTimer* t) { close(); })),
+      timed_events_(state,
+                    [this] (const Effect& effect) { apply_effect(effect); },
+                    [this] (const Effect& effect) { revert_effect(effect); }) {
     info("New connection %p using profile %s\n", this,
          profile->profile_config().id().c_str());
 
@@ -174,55 +240,38 @@ Connection::Connection(Profile* profile, Packet* p, State* state)
     server_.set_other(&client_);
 
     if (profile->profile_config().has_downlink()) {
-        client_.throttler()->enable(profile->profile_config().downlink());
+        client_.throttler()->enable(profile->profile_config().downlink(),
+                                    profile->downlink_events());
     }
 
     if (profile->profile_config().has_uplink()) {
-        server_.throttler()->enable(profile->profile_config().uplink());
+        server_.throttler()->enable(profile->profile_config().uplink(),
+                                    profile->uplink_events());
     }
 
     client_.record_packet_rx(p);
-    server_.queue_packet_tx(p);
+    server_.record_packet_tx(p);
+    profile_->admission()->connections++;
 
-    idle_timer_.reschedule(120);
+    // The connection started with the first SYN, not with the SYN-ACK
+    // that promoted it from the half-open table.
+    idle_timer_.reschedule(first_syn_timestamp + 120 - ev_now(state->loop));
 
-    for (auto event : profile->profile_config().timed_event()) {
-        auto apply = [this, event] (Timer* t) {
-            apply_timed_effect(t, event);
-        };
-        auto revert = [this, event] (Timer* t) {
-            revert_timed_effect(t, event);
-        };
-
-        event_timers_.push_back(new Timer(state, apply));
-        event_timers_.back()->reschedule(event.trigger_time());
-
-        if (event.has_duration()) {
-            event_timers_.push_back(new Timer(state, revert));
-            event_timers_.back()->reschedule(event.trigger_time() +
-                                             event.duration());
-        }
+    if (!profile->timed_events()->empty()) {
+        timed_events_.start(profile->timed_events(), first_syn_timestamp);
     }
-}
 
-Connection::~Connection() {
-    for (auto event_timer : event_timers_) {
-        delete event_timer;
-    }
+    // Profile events that are in progress apply to this connection too,
+    // but drops that happened before it was created don't.
+    const ProfileParameters& parameters =
+        profile->profile_events()->at(ev_now(state->loop));
+    profile_parameters_.downlink_drop_bytes = parameters.downlink_drop_bytes;
+    profile_parameters_.uplink_drop_bytes = parameters.uplink_drop_bytes;
+    update_profile_parameters();
 }
 
-void Connection::apply_timed_effect(Timer* timer, const TimedEvent& event) {
-    apply_effect(event.effect());
-    if (event.has_repeat_interval()) {
-        timer->reschedule(event.repeat_interval());
-    }
-}
-
-void Connection::revert_timed_effect(Timer* timer, const TimedEvent& event) {
-    revert_effect(event.effect());
-    if (event.has_repeat_interval()) {
-        timer->reschedule(event.repeat_interval());
-    }
+Connection::~Connection() {
+    profile_->admission()->connections--;
 }
 
 void Connection::apply_effect(const Effect& effect) {
@@ -245,7 +294,44 @@ void Connection::revert_effect(const Effect& effect) {
     server_.throttler()->revert(effect.uplink());
 }
 
+void Connection::update_profile_parameters() {
+    const ProfileParameters& parameters =
+        profile_->profile_events()->at(ev_now(state_->loop));
+    if (parameters.epoch == profile_parameters_.epoch) {
+        return;
+    }
+
+    const ProfileParameters& old = profile_parameters_;
+    Effect delta;
+    if (parameters.extra_rtt != old.extra_rtt) {
+        delta.set_extra_rtt(parameters.extra_rtt - old.extra_rtt);
+    }
+
+    LinkPropertiesChange* downlink = delta.mutable_downlink();
+    downlink->set_throughput_kbps_change(parameters.downlink_kbps_change -
+                                         old.downlink_kbps_change);
+    // The totals can go down on a config reload; there's nothing to
+    // undo for drops.
+    if (parameters.downlink_drop_bytes > old.downlink_drop_bytes) {
+        downlink->set_drop_bytes(parameters.downlink_drop_bytes -
+                                 old.downlink_drop_bytes);
+    }
+
+    LinkPropertiesChange* uplink = delta.mutable_uplink();
+    uplink->set_throughput_kbps_change(parameters.uplink_kbps_change -
+                                       old.uplink_kbps_change);
+    if (parameters.uplink_drop_bytes > old.uplink_drop_bytes) {
+        uplink->set_drop_bytes(parameters.uplink_drop_bytes -
+                               old.uplink_drop_bytes);
+    }
+
+    apply_effect(delta);
+    profile_parameters_ = parameters;
+}
+
 void Connection::receive(Packet* p) {
+    update_profile_parameters();
+
     TcpFlow* source_flow = packet_source_flow(p);
     TcpFlow* target_flow = source_flow->other();
 
@@ -268,7 +354,7 @@ void Connection::receive(Packet* p) {
         if (!from_client && client_.is_valid_synack(p)) {
             connection_state_ = STATE_SYN_ACK;
             double server_side_rtt = ev_now(state_->loop) - first_syn_timestamp_;
-            double target_rtt = profile_->profile_config().target_rtt();
+            double target_rtt = compiled_->config().target_rtt();
             if (target_rtt && target_rtt > server_side_rtt) {
                 double delay_s = target_rtt - server_side_rtt;
                 client_.set_delay(delay_s);
@@ -278,11 +364,8 @@ void Connection::receive(Packet* p) {
         } else {
             // Getting packets that don't make sense for this handshake.
             // Give up on the connection.
-            warn("Handshake confusion, expected SYN-ACK from server. "
-                 "Bailing out.\n");
-            std::string text;
-            google::protobuf::TextFormat::PrintToString(*p, &text);
-            warn("packet: %s\n", text.c_str());
+            p->warn_summary("Handshake confusion, expected SYN-ACK from "
+                            "server. Bailing out");
             goto fail;
         }
         // Note: we don't support SYN-SYN connection opening.
@@ -343,8 +426,9 @@ TcpFlow* Connection::packet_source_flow(Packet* p) {
 
 class ConnectionIpv4 : public Connection {
 public:
-    ConnectionIpv4(Profile* profile, Packet* p, State* state)
-        : Connection(profile, p, state) {
+    ConnectionIpv4(Profile* profile, Packet* p, State* state,
+                   ev_tstamp first_syn_timestamp)
+        : Connection(profile, p, state, first_syn_timestamp) {
     }
 
     virtual int addr_bytes() const { return 4; }
@@ -352,19 +436,23 @@ public:
 
 class ConnectionIpv6 : public Connection {
 public:
-    ConnectionIpv6(Profile* profile, Packet* p, State* state)
-        : Connection(profile, p, state) {
+    ConnectionIpv6(Profile* profile, Packet* p, State* state,
+                   ev_tstamp first_syn_timestamp)
+        : Connection(profile, p, state, first_syn_timestamp) {
     }
 
     virtual int addr_bytes() const { return 16; }
 };
 
-Connection* Connection::make(Profile* profile, Packet* p, State* state) {
+Connection* Connection::make(Profile* profile, Packet* p, State* state,
+                             ev_tstamp first_syn_timestamp) {
     Connection* connection;
     if (p->has_ipv4()) {
-        connection = new ConnectionIpv4(profile, p, state);
+        connection = new ConnectionIpv4(profile, p, state,
+                                        first_syn_timestamp);
     } else if (p->has_ipv6()) {
-        connection = new ConnectionIpv6(profile, p, state);
+        connection = new ConnectionIpv6(profile, p, state,
+                                        first_syn_timestamp);
     } else {
         fail("TCP without IPv4 or IPv6?");
     }
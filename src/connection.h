@@ -7,13 +7,18 @@
 #define _CONNECTION_H_
 
 #include <cstdint>
-#include <deque>
+#include <memory>
 #include <string>
 
 #include "connection-table.h"
+#include "delay-queue.h"
+#include "memory-budget.h"
 #include "pcap-dumper.h"
+#include "shared-throttler.h"
 #include "state.h"
 #include "throttler.h"
+#include "timed-events.h"
+#include "timer-wheel.h"
 
 // One half of a TCP connection.
 class TcpFlow {
@@ -34,8 +39,13 @@ public:
 
     // Read the information from a received packet and update the flow status.
     void record_packet_rx(Packet* p);
-    // Queue a packet for transmission in this direction.
+    // Queue a packet for transmission in this direction. The contents
+    // of the packet are moved to the queue, leaving "p" empty, unless
+    // nothing is impaired right now, in which case it's sent right away.
     void queue_packet_tx(Packet* p);
+    // Record a packet that was already sent in this direction without
+    // going through the transmit queue.
+    void record_packet_tx(Packet* p);
 
     // Is this packet a valid SYNACK (compared to the SYN)?
     bool is_valid_synack(Packet* p);
@@ -57,23 +67,33 @@ public:
     bool can_close();
 
 private:
+    // Put a packet released by the throttler in the transmit queue.
+    void delay_packet(Packet* p, ev_tstamp released_at);
     void reschedule_transmit_timer();
     void transmit();
 
+    // Drop the packet at the head of the transmit queue, if there is
+    // one, to make room in the memory budget.
+    bool drop_oldest();
+
     State* state_;
     TcpFlow* other_;
     IoInterface* iface_;
+    // Packet memory used by this flow.
+    MemoryAccount memory_;
     PcapDumper dumper_;
 
-    // Packet transmit queue. The packet at the head of the queue
-    // should be transmitted at the timestamp indicated in the first
-    // element of the pair.
-    std::deque<std::pair<ev_tstamp, Packet*> > packets_;
-    Timer transmit_timer_;
+    // Packet transmit queue.
+    DelayQueue packets_;
+    WheelTimer transmit_timer_;
 
     // Amount of time to delay each packet transmitted toward this direction.
     double delay_s_;
 
+    // Number of packets sent without going through the throttlers and
+    // delay queue (shared by all flows).
+    uint64_t* fast_path_packets_;
+
     // True if a RST / FIN has been received on this flow.
     bool received_rst_;
     bool received_fin_;
@@ -91,6 +111,9 @@ private:
 
     // Bandwidth limit on data sent to this flow.
     Throttler throttler_;
+    // Our queue in the shared throttlers of the profile and interface,
+    // or NULL if they don't limit anything.
+    std::unique_ptr<SharedThrottler::Flow> shared_;
 };
 
 // A TCP connection.
@@ -113,8 +136,10 @@ public:
     ConnectionKey* key() { return &key_; }
 
     // Make a new connection based on a SYN packet, using the specified
-    // profile. Insert the connection in the socket table.
-    static Connection* make(Profile* profile, Packet* p, State* state);
+    // profile. Insert the connection in the socket table. The SYN
+    // must already have been forwarded.
+    static Connection* make(Profile* profile, Packet* syn, State* state,
+                            ev_tstamp first_syn_timestamp);
 
     // TCP state machine for the connection.
     enum ConnectionState {
@@ -125,17 +150,20 @@ public:
     };
 
 protected:
-    explicit Connection(Profile* profile, Packet* p, State* state);
-
-    void apply_timed_effect(Timer* timer, const TimedEvent& event);
-    void revert_timed_effect(Timer* timer, const TimedEvent& event);
+    Connection(Profile* profile, Packet* syn, State* state,
+               ev_tstamp first_syn_timestamp);
 
     void apply_effect(const Effect& effect);
     void revert_effect(const Effect& effect);
+    // Catch up with any change in the profile events.
+    void update_profile_parameters();
 
 private:
     State* state_;
     Profile* profile_;
+    // The version of the profile configuration the connection was
+    // created with. Keeps it alive across reloads.
+    std::shared_ptr<const CompiledProfile> compiled_;
     ev_tstamp first_syn_timestamp_;
 
     ConnectionState connection_state_;
@@ -146,10 +174,13 @@ private:
     TcpFlow client_;
     TcpFlow server_;
     // Close the connection if it is idle for too long.
-    Timer idle_timer_;
+    WheelTimer idle_timer_;
 
     // Timed network events for this connection (as per configuration).
-    std::vector<Timer*> event_timers_;
+    TimedEventCursor timed_events_;
+    // The profile event parameters that have been applied to this
+    // connection.
+    ProfileParameters profile_parameters_;
 };
 
 #endif // CONNECTION_H
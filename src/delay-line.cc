@@ -0,0 +1,168 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#include "delay-line.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "realtime.h"
+
+// Records start on cache line boundaries.
+static const size_t kAlignment = 64;
+static const size_t kHugePageSize = 2 * 1024 * 1024;
+
+struct DelayLineStore::Record {
+    // Size of the record including this header and padding.
+    uint32_t size;
+    uint32_t released;
+    uint8_t data[0];
+};
+
+static size_t align(size_t size, size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+DelayLineStore::DelayLineStore(Stats* stats, size_t bytes,
+                               const std::string& file, bool hugepages,
+                               size_t spill_above)
+    : file_(file),
+      hugepages_(hugepages),
+      spill_above_(spill_above),
+      base_(NULL),
+      capacity_(bytes / kAlignment * kAlignment),
+      head_(0),
+      tail_(0),
+      used_(0),
+      spilled_(stats->counter("delay_line.spilled")),
+      full_(stats->counter("delay_line.full")) {
+    stats->add_gauge("delay_line.bytes", [this] () { return used_; });
+    stats->add_gauge("delay_line.capacity", [this] () { return capacity_; });
+}
+
+DelayLineStore::~DelayLineStore() {
+    // The view never owns its frame.
+    view_.ethh_ = NULL;
+    if (base_) {
+        munmap(base_, capacity_);
+    }
+}
+
+bool DelayLineStore::open() {
+    void* base = MAP_FAILED;
+
+    if (!file_.empty()) {
+        int fd = ::open(file_.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd < 0) {
+            warn_with_errno("couldn't open '%s'", file_.c_str());
+            return false;
+        }
+        if (ftruncate(fd, capacity_) < 0) {
+            warn_with_errno("couldn't resize '%s'", file_.c_str());
+            close(fd);
+            return false;
+        }
+        base = mmap(NULL, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fd, 0);
+        close(fd);
+    } else {
+        if (hugepages_) {
+            size_t capacity = align(capacity_, kHugePageSize);
+            base = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (base == MAP_FAILED) {
+                warn_with_errno("no huge pages for the delay line, "
+                                "using normal pages");
+            } else {
+                capacity_ = capacity;
+            }
+        }
+        if (base == MAP_FAILED) {
+            base = mmap(NULL, capacity_, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (base != MAP_FAILED && hugepages_) {
+                madvise(base, capacity_, MADV_HUGEPAGE);
+            }
+        }
+    }
+
+    if (base == MAP_FAILED) {
+        warn_with_errno("couldn't map %zu bytes for the delay line",
+                        capacity_);
+        return false;
+    }
+
+    base_ = static_cast<uint8_t*>(base);
+    realtime_prefault(base_, capacity_);
+    info("Delay line store of %zu bytes", capacity_);
+    return true;
+}
+
+DelayLineStore::Handle DelayLineStore::append(const void* frame,
+                                              uint32_t length) {
+    size_t size = align(sizeof(Record) + length, kAlignment);
+
+    if (used_ == 0) {
+        // Start over from the beginning, for the most contiguous space.
+        head_ = tail_ = 0;
+    }
+
+    // If the record doesn't fit before the end of the mapping, the rest
+    // of the mapping is skipped with a dummy record.
+    size_t skip = head_ + size > capacity_ ? capacity_ - head_ : 0;
+    if (used_ + skip + size > capacity_) {
+        ++*full_;
+        return kNone;
+    }
+
+    if (skip) {
+        Record* padding = record(head_);
+        padding->size = skip;
+        padding->released = true;
+        used_ += skip;
+        head_ = 0;
+    }
+
+    Handle handle = head_;
+    Record* r = record(head_);
+    r->size = size;
+    r->released = false;
+    memcpy(r->data, frame, length);
+
+    used_ += size;
+    head_ += size;
+    if (head_ == capacity_) {
+        head_ = 0;
+    }
+
+    ++*spilled_;
+    return handle;
+}
+
+void DelayLineStore::release(Handle handle) {
+    record(handle)->released = true;
+
+    while (used_ > 0) {
+        Record* r = record(tail_);
+        if (!r->released) {
+            break;
+        }
+        used_ -= r->size;
+        tail_ += r->size;
+        if (tail_ == capacity_) {
+            tail_ = 0;
+        }
+    }
+}
+
+Packet* DelayLineStore::view(Handle handle, uint32_t length) {
+    view_.ethh_ = reinterpret_cast<pkt_eth_t*>(record(handle)->data);
+    view_.length_ = length;
+    view_.from_iface_ = NULL;
+    return &view_;
+}
@@ -0,0 +1,84 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+// Storage for the frames of packets waiting out a long delay. With large
+// bandwidth-delay products the delay queues can hold gigabytes, and
+// keeping each frame in its own heap allocation fragments the heap. The
+// store is instead one big mapping used as an append-only ring: frames
+// are copied in at the head, and space is reclaimed from the tail once
+// the records there have been released.
+
+#ifndef _DELAY_LINE_H_
+#define _DELAY_LINE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "base.h"
+#include "packet.h"
+#include "stats.h"
+
+class DelayLineStore {
+public:
+    // Identifies a record in the store.
+    typedef int64_t Handle;
+    static const Handle kNone = -1;
+
+    // A store of "bytes" bytes. If "file" is not empty, the store is
+    // backed by that file; otherwise by anonymous memory, on huge pages
+    // if "hugepages" is set. Flows start spilling into the store once
+    // they have "spill_above" packets queued.
+    DelayLineStore(Stats* stats, size_t bytes, const std::string& file,
+                   bool hugepages, size_t spill_above);
+    ~DelayLineStore();
+
+    // Map the store. Return false on error.
+    bool open();
+
+    // True if a queue of "queued" packets should spill new packets into
+    // the store.
+    bool should_spill(size_t queued) const {
+        return queued >= spill_above_;
+    }
+
+    // Copy a frame into the store. Return kNone if it doesn't fit.
+    Handle append(const void* frame, uint32_t length);
+    // Free the record. Records can be released in any order, but the
+    // space is only reused once everything older has been released too.
+    void release(Handle handle);
+
+    // A packet for sending the frame in this record. Only valid until
+    // the next call, and must not be deleted.
+    Packet* view(Handle handle, uint32_t length);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(DelayLineStore);
+
+    struct Record;
+
+    Record* record(size_t offset) {
+        return reinterpret_cast<Record*>(base_ + offset);
+    }
+
+    std::string file_;
+    bool hugepages_;
+    size_t spill_above_;
+
+    uint8_t* base_;
+    size_t capacity_;
+    // Offset of the next record to write, and of the oldest record.
+    size_t head_;
+    size_t tail_;
+    // Bytes between the tail and the head.
+    size_t used_;
+
+    Packet view_;
+
+    uint64_t* spilled_;
+    uint64_t* full_;
+};
+
+#endif // _DELAY_LINE_H_
@@ -0,0 +1,94 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#include "delay-queue.h"
+
+DelayQueue::DelayQueue(DelayQueuePool* pool, DelayLineStore* store)
+    : pool_(pool),
+      store_(store),
+      entries_(inline_),
+      capacity_(kInlineEntries),
+      head_(0),
+      size_(0),
+      bytes_(0) {
+}
+
+DelayQueue::~DelayQueue() {
+    while (!empty()) {
+        pop_front();
+    }
+}
+
+static int order_of(size_t capacity) {
+    int order = 0;
+    while ((size_t(1) << order) < capacity) {
+        ++order;
+    }
+    return order;
+}
+
+void DelayQueue::grow() {
+    size_t capacity = capacity_ * 2;
+    Entry* entries = pool_->allocate(order_of(capacity));
+    for (size_t i = 0; i < size_; ++i) {
+        entries[i] = entries_[(head_ + i) & (capacity_ - 1)];
+    }
+
+    if (entries_ != inline_) {
+        pool_->free(entries_, order_of(capacity_));
+    }
+    entries_ = entries;
+    capacity_ = capacity;
+    head_ = 0;
+}
+
+void DelayQueue::shrink() {
+    pool_->free(entries_, order_of(capacity_));
+    entries_ = inline_;
+    capacity_ = kInlineEntries;
+    head_ = 0;
+}
+
+DelayQueuePool::DelayQueuePool(Stats* stats)
+    : used_bytes_(0),
+      free_bytes_(0) {
+    stats->add_gauge("delay_queue_pool.used_bytes",
+                     [this] () { return used_bytes_; });
+    stats->add_gauge("delay_queue_pool.free_bytes",
+                     [this] () { return free_bytes_; });
+}
+
+DelayQueuePool::~DelayQueuePool() {
+    for (auto& rings : free_) {
+        for (auto ring : rings) {
+            delete[] ring;
+        }
+    }
+}
+
+DelayQueue::Entry* DelayQueuePool::allocate(int order) {
+    uint64_t bytes = sizeof(DelayQueue::Entry) << order;
+    used_bytes_ += bytes;
+
+    if (order < (int) free_.size() && !free_[order].empty()) {
+        DelayQueue::Entry* entries = free_[order].back();
+        free_[order].pop_back();
+        free_bytes_ -= bytes;
+        return entries;
+    }
+
+    return new DelayQueue::Entry[size_t(1) << order];
+}
+
+void DelayQueuePool::free(DelayQueue::Entry* entries, int order) {
+    uint64_t bytes = sizeof(DelayQueue::Entry) << order;
+    used_bytes_ -= bytes;
+    free_bytes_ += bytes;
+
+    if (order >= (int) free_.size()) {
+        free_.resize(order + 1);
+    }
+    free_[order].push_back(entries);
+}
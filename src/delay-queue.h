@@ -0,0 +1,151 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#ifndef _DELAY_QUEUE_H_
+#define _DELAY_QUEUE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "base.h"
+#include "delay-line.h"
+#include "packet.h"
+#include "stats.h"
+
+class DelayQueuePool;
+
+// The packets of one flow waiting to be sent after a fixed delay, in
+// order of departure. Each packet is either a heap allocated Packet, or
+// a record in the delay line store. Owns the packets in the queue.
+//
+// The queue is a power-of-two ring of descriptors. Small queues fit in
+// the object itself; larger rings come from a DelayQueuePool.
+class DelayQueue {
+public:
+    struct Entry {
+        // When the packet is due to be sent.
+        double due;
+        // A Packet*, or a delay line store handle tagged with kSpilled.
+        uint64_t buffer;
+        uint32_t length;
+
+        bool spilled() const { return buffer & kSpilled; }
+        Packet* packet() const { return reinterpret_cast<Packet*>(buffer); }
+        DelayLineStore::Handle handle() const { return buffer & ~kSpilled; }
+    };
+
+    // Number of packets that fit in the queue without using the pool.
+    static const size_t kInlineEntries = 8;
+
+    // Packets may be spilled to "store" (which can be NULL).
+    DelayQueue(DelayQueuePool* pool, DelayLineStore* store);
+    ~DelayQueue();
+
+    bool empty() const { return size_ == 0; }
+    // Number of packets in the queue.
+    size_t size() const { return size_; }
+    // Total length of the packets in the queue.
+    uint64_t bytes() const { return bytes_; }
+
+    const Entry& front() const { return entries_[head_]; }
+
+    // Queue a packet, due at "due". Takes ownership.
+    void push_back(Packet* p, double due) {
+        if (size_ == capacity_) {
+            grow();
+        }
+
+        Entry& entry = entries_[(head_ + size_) & (capacity_ - 1)];
+        entry.due = due;
+        entry.buffer = reinterpret_cast<uint64_t>(p);
+        entry.length = p->length_;
+
+        if (store_ && store_->should_spill(size_)) {
+            DelayLineStore::Handle handle =
+                store_->append(p->ethh_, p->length_);
+            if (handle != DelayLineStore::kNone) {
+                entry.buffer = handle | kSpilled;
+                delete p;
+            }
+        }
+
+        ++size_;
+        bytes_ += entry.length;
+    }
+
+    // The packet at the head of the queue. Still owned by the queue, so
+    // only valid until the next pop_front().
+    Packet* front_packet() {
+        const Entry& entry = front();
+        if (entry.spilled()) {
+            return store_->view(entry.handle(), entry.length);
+        }
+        return entry.packet();
+    }
+
+    // Drop the packet at the head of the queue.
+    void pop_front() {
+        const Entry& entry = entries_[head_];
+        if (entry.spilled()) {
+            store_->release(entry.handle());
+        } else {
+            delete entry.packet();
+        }
+        head_ = (head_ + 1) & (capacity_ - 1);
+        --size_;
+        bytes_ -= entry.length;
+
+        if (size_ == 0 && entries_ != inline_) {
+            shrink();
+        }
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(DelayQueue);
+
+    // Store handles are 64-byte aligned and packets at least 8-byte
+    // aligned, so the low bit tells them apart.
+    static const uint64_t kSpilled = 1;
+
+    // Move to a ring twice the size.
+    void grow();
+    // Return an empty ring to the pool, and go back to the inline one.
+    void shrink();
+
+    DelayQueuePool* pool_;
+    DelayLineStore* store_;
+    // A ring of capacity_ (a power of two) entries, either inline_ or
+    // from the pool.
+    Entry* entries_;
+    size_t capacity_;
+    size_t head_;
+    size_t size_;
+    uint64_t bytes_;
+    Entry inline_[kInlineEntries];
+};
+
+// Rings for delay queues that outgrow their inline space. Freed rings
+// are kept for reuse by the next queue that needs one of the same size.
+class DelayQueuePool {
+public:
+    explicit DelayQueuePool(Stats* stats);
+    ~DelayQueuePool();
+
+    // A ring of 2^order entries.
+    DelayQueue::Entry* allocate(int order);
+    void free(DelayQueue::Entry* entries, int order);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(DelayQueuePool);
+
+    // Free rings, by order.
+    std::vector<std::vector<DelayQueue::Entry*> > free_;
+    // Bytes in rings handed out / kept for reuse.
+    uint64_t used_bytes_;
+    uint64_t free_bytes_;
+};
+
+#endif // _DELAY_QUEUE_H_
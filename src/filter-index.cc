@@ -0,0 +1,421 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#include "filter-index.h"
+
+#include <arpa/inet.h>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+// The fields of a packet the index looks at, as read by the BPF filters
+// (at fixed offsets from the start of the ethernet header).
+struct PacketFields {
+    // 0 for IPv4, 1 for IPv6.
+    int family;
+    const uint8_t* src;
+    const uint8_t* dst;
+    uint16_t src_port;
+    uint16_t dst_port;
+};
+
+static bool is_and(const std::string& token) {
+    return token == "and" || token == "&&";
+}
+
+// A decimal number up to 65535. pcap reads numbers with a leading zero
+// as octal (and "0x..." as hex), so those are left for BPF.
+static bool parse_number(const std::string& value, int* number) {
+    if (value.empty() || value.size() > 5 ||
+        value.find_first_not_of("0123456789") != std::string::npos ||
+        (value[0] == '0' && value.size() > 1)) {
+        return false;
+    }
+    *number = atoi(value.c_str());
+    return *number <= 65535;
+}
+
+// A "host" is a single address literal, a "net" must have an explicit
+// prefix length (the pcap defaults for other forms depend on the
+// address class).
+static bool parse_prefix(const std::string& value, bool net,
+                         FilterPredicate::Prefix* prefix) {
+    size_t slash = value.find('/');
+    if (net != (slash != std::string::npos)) {
+        return false;
+    }
+    std::string address = value.substr(0, slash);
+
+    memset(prefix, 0, sizeof(*prefix));
+    if (inet_pton(AF_INET, address.c_str(), prefix->address) == 1) {
+        prefix->family = 4;
+        prefix->length = 32;
+    } else if (inet_pton(AF_INET6, address.c_str(), prefix->address) == 1) {
+        prefix->family = 6;
+        prefix->length = 128;
+    } else {
+        return false;
+    }
+
+    if (net) {
+        int length;
+        if (!parse_number(value.substr(slash + 1), &length) ||
+            length > prefix->length) {
+            return false;
+        }
+        prefix->length = length;
+    }
+    return true;
+}
+
+static bool set_family(FilterPredicate* predicate, int family) {
+    if (predicate->family && predicate->family != family) {
+        // Could never match; leave that to BPF.
+        return false;
+    }
+    predicate->family = family;
+    return true;
+}
+
+// Parse one primitive, like "ip", "tcp dst port 80" or "src net
+// 10.0.0.0/8", starting at tokens[*pos].
+static bool parse_primitive(const std::vector<std::string>& tokens,
+                            size_t* pos, FilterPredicate* predicate) {
+    std::string proto;
+    const std::string& first = tokens[*pos];
+    if (first == "tcp" || first == "ip" || first == "ip6") {
+        proto = first;
+        ++*pos;
+        if (*pos == tokens.size() || is_and(tokens[*pos])) {
+            // Only TCP packets are classified.
+            return proto == "tcp" ||
+                set_family(predicate, proto == "ip" ? 4 : 6);
+        }
+    }
+
+    FilterPredicate::Direction direction = FilterPredicate::EITHER;
+    if (tokens[*pos] == "src") {
+        direction = FilterPredicate::SRC;
+        ++*pos;
+    } else if (tokens[*pos] == "dst") {
+        direction = FilterPredicate::DST;
+        ++*pos;
+    }
+    if (*pos + 2 > tokens.size()) {
+        return false;
+    }
+
+    const std::string& kind = tokens[(*pos)++];
+    const std::string& value = tokens[(*pos)++];
+
+    if (kind == "port") {
+        if ((proto != "" && proto != "tcp") ||
+            predicate->port[direction] >= 0) {
+            return false;
+        }
+        return parse_number(value, &predicate->port[direction]);
+    }
+
+    if (kind == "host" || kind == "net") {
+        FilterPredicate::Prefix* prefix = &predicate->address[direction];
+        if (proto == "tcp" || prefix->family) {
+            return false;
+        }
+        if (!parse_prefix(value, kind == "net", prefix)) {
+            return false;
+        }
+        return proto == "" ||
+            prefix->family == (proto == "ip" ? 4 : 6);
+    }
+
+    return false;
+}
+
+FilterPredicate::FilterPredicate()
+    : family(0) {
+    for (int i = 0; i < DIRECTIONS; ++i) {
+        memset(&address[i], 0, sizeof(address[i]));
+        port[i] = -1;
+    }
+}
+
+std::unique_ptr<FilterPredicate> FilterPredicate::parse(
+    const std::string& filter) {
+    std::vector<std::string> tokens;
+    std::istringstream stream(filter);
+    std::string token;
+    while (stream >> token) {
+        tokens.push_back(token);
+    }
+
+    std::unique_ptr<FilterPredicate> predicate(new FilterPredicate());
+    size_t pos = 0;
+    while (pos < tokens.size()) {
+        if (pos > 0) {
+            if (!is_and(tokens[pos]) || ++pos == tokens.size()) {
+                return NULL;
+            }
+        }
+        if (!parse_primitive(tokens, &pos, predicate.get())) {
+            return NULL;
+        }
+    }
+
+    return predicate;
+}
+
+FilterIndex::PrefixTrie::PrefixTrie() {
+    Node root = { { -1, -1 }, -1 };
+    nodes_.push_back(root);
+}
+
+void FilterIndex::PrefixTrie::insert(const uint8_t* address, int length,
+                                     size_t profile, size_t words) {
+    int node = 0;
+    for (int i = 0; i < length; ++i) {
+        int bit = (address[i / 8] >> (7 - i % 8)) & 1;
+        if (nodes_[node].child[bit] < 0) {
+            Node child = { { -1, -1 }, -1 };
+            nodes_[node].child[bit] = nodes_.size();
+            nodes_.push_back(child);
+        }
+        node = nodes_[node].child[bit];
+    }
+
+    if (nodes_[node].bitmap < 0) {
+        nodes_[node].bitmap = bitmaps_.size();
+        bitmaps_.push_back(Bitmap(words, 0));
+    }
+    FilterIndex::set(&bitmaps_[nodes_[node].bitmap], profile);
+}
+
+void FilterIndex::PrefixTrie::finish() {
+    finish(0, NULL);
+}
+
+void FilterIndex::PrefixTrie::finish(int node, const Bitmap* inherited) {
+    if (nodes_[node].bitmap >= 0) {
+        Bitmap& bitmap = bitmaps_[nodes_[node].bitmap];
+        if (inherited) {
+            for (size_t i = 0; i < bitmap.size(); ++i) {
+                bitmap[i] |= (*inherited)[i];
+            }
+        }
+        inherited = &bitmap;
+    }
+
+    for (int bit = 0; bit < 2; ++bit) {
+        if (nodes_[node].child[bit] >= 0) {
+            // The trie is only as deep as the longest prefix (128).
+            finish(nodes_[node].child[bit], inherited);
+        }
+    }
+}
+
+const FilterIndex::Bitmap* FilterIndex::PrefixTrie::lookup(
+    const uint8_t* address, int bits) const {
+    const Bitmap* found = NULL;
+    int node = 0;
+    for (int i = 0; node >= 0; ++i) {
+        if (nodes_[node].bitmap >= 0) {
+            found = &bitmaps_[nodes_[node].bitmap];
+        }
+        if (i == bits) {
+            break;
+        }
+        node = nodes_[node].child[(address[i / 8] >> (7 - i % 8)) & 1];
+    }
+    return found;
+}
+
+FilterIndex::FilterIndex(const std::vector<const FilterPredicate*>& predicates)
+    : size_(predicates.size()),
+      words_((size_ + 63) / 64),
+      residual_count_(0),
+      residual_(words_, 0) {
+    for (auto& dimension : dimensions_) {
+        dimension.any.assign(words_, 0);
+        dimension.families[0].assign(words_, 0);
+        dimension.families[1].assign(words_, 0);
+    }
+
+    for (size_t i = 0; i < size_; ++i) {
+        const FilterPredicate* predicate = predicates[i];
+        if (predicate == NULL) {
+            set(&residual_, i);
+            ++residual_count_;
+            continue;
+        }
+
+        Dimension* dimension = &dimensions_[FAMILY];
+        if (predicate->family) {
+            dimension->used = true;
+            set(&dimension->families[predicate->family == 6], i);
+        } else {
+            set(&dimension->any, i);
+        }
+
+        for (int direction = 0; direction < FilterPredicate::DIRECTIONS;
+             ++direction) {
+            const FilterPredicate::Prefix& prefix =
+                predicate->address[direction];
+            dimension = &dimensions_[SRC_ADDRESS + direction];
+            if (prefix.family) {
+                dimension->used = true;
+                dimension->prefixes[prefix.family == 6].insert(
+                    prefix.address, prefix.length, i, words_);
+            } else {
+                set(&dimension->any, i);
+            }
+
+            int port = predicate->port[direction];
+            dimension = &dimensions_[SRC_PORT + direction];
+            if (port >= 0) {
+                dimension->used = true;
+                Bitmap& bitmap = dimension->ports[port];
+                if (bitmap.empty()) {
+                    bitmap.assign(words_, 0);
+                }
+                set(&bitmap, i);
+            } else {
+                set(&dimension->any, i);
+            }
+        }
+    }
+
+    for (auto& dimension : dimensions_) {
+        dimension.prefixes[0].finish();
+        dimension.prefixes[1].finish();
+    }
+}
+
+// Read the indexed fields, the way the filters would. Packets that the
+// filters might look at differently (fragments, IPv6 extension headers,
+// VLAN tags, unusual header lengths) are left for the filters.
+static bool read_fields(const Packet* p, PacketFields* fields) {
+    const uint8_t* frame = reinterpret_cast<const uint8_t*>(p->ethh_);
+    if (p->length_ < PKT_ETHER_HEADER_LEN + 1) {
+        return false;
+    }
+
+    const uint8_t* ports;
+    uint16_t ethertype = ntohs(p->ethh_->h_proto);
+    if (ethertype == PKT_ETHER_TYPE_IP) {
+        size_t header_length = 4 * (frame[PKT_ETHER_HEADER_LEN] & 0xf);
+        if (header_length < 20 ||
+            p->length_ < PKT_ETHER_HEADER_LEN + header_length + 4 ||
+            frame[23] != IPPROTO_TCP ||
+            ((frame[20] << 8 | frame[21]) & 0x1fff) != 0) {
+            return false;
+        }
+        fields->family = 0;
+        fields->src = frame + 26;
+        fields->dst = frame + 30;
+        ports = frame + PKT_ETHER_HEADER_LEN + header_length;
+    } else if (ethertype == PKT_ETHER_TYPE_IPV6) {
+        if (p->length_ < 58 || frame[20] != IPPROTO_TCP) {
+            return false;
+        }
+        fields->family = 1;
+        fields->src = frame + 22;
+        fields->dst = frame + 38;
+        ports = frame + 54;
+    } else {
+        return false;
+    }
+
+    fields->src_port = ports[0] << 8 | ports[1];
+    fields->dst_port = ports[2] << 8 | ports[3];
+    return true;
+}
+
+// Clear the bits in "bitmap" for profiles not in any of the others.
+static void intersect(FilterIndex::Bitmap* bitmap,
+                      const FilterIndex::Bitmap& any,
+                      const FilterIndex::Bitmap* a,
+                      const FilterIndex::Bitmap* b) {
+    for (size_t i = 0; i < bitmap->size(); ++i) {
+        (*bitmap)[i] &= any[i] | (a ? (*a)[i] : 0) | (b ? (*b)[i] : 0);
+    }
+}
+
+static const FilterIndex::Bitmap* find_port(
+    const std::unordered_map<uint16_t, FilterIndex::Bitmap>& ports,
+    uint16_t port) {
+    auto it = ports.find(port);
+    return it == ports.end() ? NULL : &it->second;
+}
+
+bool FilterIndex::candidates(const Packet* p, Bitmap* candidates) const {
+    PacketFields fields;
+    if (!read_fields(p, &fields)) {
+        return false;
+    }
+
+    candidates->assign(words_, ~UINT64_C(0));
+    if (size_ % 64) {
+        candidates->back() = (UINT64_C(1) << (size_ % 64)) - 1;
+    }
+
+    int bits = fields.family ? 128 : 32;
+    for (int i = 0; i < DIMENSIONS; ++i) {
+        const Dimension& dimension = dimensions_[i];
+        if (!dimension.used) {
+            continue;
+        }
+
+        const PrefixTrie& trie = dimension.prefixes[fields.family];
+        switch (i) {
+        case FAMILY:
+            intersect(candidates, dimension.any,
+                      &dimension.families[fields.family], NULL);
+            break;
+        case SRC_ADDRESS:
+            intersect(candidates, dimension.any,
+                      trie.lookup(fields.src, bits), NULL);
+            break;
+        case DST_ADDRESS:
+            intersect(candidates, dimension.any,
+                      trie.lookup(fields.dst, bits), NULL);
+            break;
+        case EITHER_ADDRESS:
+            intersect(candidates, dimension.any,
+                      trie.lookup(fields.src, bits),
+                      trie.lookup(fields.dst, bits));
+            break;
+        case SRC_PORT:
+            intersect(candidates, dimension.any,
+                      find_port(dimension.ports, fields.src_port), NULL);
+            break;
+        case DST_PORT:
+            intersect(candidates, dimension.any,
+                      find_port(dimension.ports, fields.dst_port), NULL);
+            break;
+        case EITHER_PORT:
+            intersect(candidates, dimension.any,
+                      find_port(dimension.ports, fields.src_port),
+                      find_port(dimension.ports, fields.dst_port));
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < words_; ++i) {
+        (*candidates)[i] |= residual_[i];
+    }
+    return true;
+}
+
+size_t FilterIndex::next(const Bitmap& bitmap, size_t begin, size_t end) {
+    size_t i = begin;
+    while (i < end) {
+        uint64_t word = bitmap[i / 64] >> (i % 64);
+        if (word) {
+            i += __builtin_ctzll(word);
+            break;
+        }
+        i = (i / 64 + 1) * 64;
+    }
+    return i < end ? i : end;
+}
@@ -0,0 +1,153 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+// A decision structure for finding which of many profile filters match
+// a TCP packet, without running the filters one by one. The common
+// filter expressions (conjunctions of host, net, port and protocol
+// primitives) are parsed into predicates when the configuration is
+// loaded. Each predicate field is indexed separately (hash tables for
+// ports, prefix tries for addresses), giving a bitmap of the profiles
+// the packet's value satisfies; intersecting the bitmaps gives the
+// matching profiles. Filters that can't be parsed are left for BPF.
+
+#ifndef _FILTER_INDEX_H_
+#define _FILTER_INDEX_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "base.h"
+#include "packet.h"
+
+// The conditions of a filter expression like
+// "tcp dst port 80 and src net 10.0.0.0/8", as applied to TCP packets.
+struct FilterPredicate {
+    enum Direction {
+        SRC,
+        DST,
+        // Either source or destination ("host 10.0.0.1", "port 80").
+        EITHER,
+        DIRECTIONS,
+    };
+
+    struct Prefix {
+        // 0 if unset, else 4 or 6.
+        int family;
+        uint8_t address[16];
+        int length;
+    };
+
+    FilterPredicate();
+
+    // Parse a filter expression. Return NULL if it's not one of the
+    // supported forms.
+    static std::unique_ptr<FilterPredicate> parse(const std::string& filter);
+
+    // 0 for any, else 4 or 6.
+    int family;
+    Prefix address[DIRECTIONS];
+    // -1 for any.
+    int port[DIRECTIONS];
+};
+
+class FilterIndex {
+public:
+    typedef std::vector<uint64_t> Bitmap;
+
+    // Index these predicates, in priority order. NULL entries can't be
+    // indexed, and are always candidates.
+    explicit FilterIndex(
+        const std::vector<const FilterPredicate*>& predicates);
+
+    size_t size() const { return size_; }
+    size_t residual() const { return residual_count_; }
+
+    // Does the index decide whether profile "i" matches? If not, its
+    // filter has to be run on the candidate packets.
+    bool exact(size_t i) const { return test(residual_, i) == false; }
+
+    // Set "candidates" to the profiles that may match this packet: the
+    // indexed ones that match, and all residual ones. Return false if
+    // the packet can't be looked up (not plain IPv4 / IPv6 TCP, as the
+    // filters would see it), in which case all filters must be run.
+    bool candidates(const Packet* p, Bitmap* candidates) const;
+
+    static bool test(const Bitmap& bitmap, size_t i) {
+        return (bitmap[i / 64] >> (i % 64)) & 1;
+    }
+    static void set(Bitmap* bitmap, size_t i) {
+        (*bitmap)[i / 64] |= UINT64_C(1) << (i % 64);
+    }
+    // The first set bit in [begin, end), or end if there is none.
+    static size_t next(const Bitmap& bitmap, size_t begin, size_t end);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(FilterIndex);
+
+    // A binary trie of address prefixes. Each node where a prefix ends
+    // holds the bitmap of the profiles whose prefix is that node or one
+    // of its ancestors, so a lookup only needs the deepest such node on
+    // the address's path.
+    class PrefixTrie {
+    public:
+        PrefixTrie();
+
+        void insert(const uint8_t* address, int length, size_t profile,
+                    size_t words);
+        // Propagate the bitmaps down the trie. Call once after all
+        // inserts.
+        void finish();
+        // The bitmap for this address, or NULL if no prefix covers it.
+        const Bitmap* lookup(const uint8_t* address, int bits) const;
+
+    private:
+        struct Node {
+            int child[2];
+            // Index into bitmaps_, or -1.
+            int bitmap;
+        };
+
+        void finish(int node, const Bitmap* inherited);
+
+        std::vector<Node> nodes_;
+        std::vector<Bitmap> bitmaps_;
+    };
+
+    // Bitmaps for one predicate field.
+    struct Dimension {
+        Dimension() : used(false) { }
+
+        // Does any predicate constrain this field?
+        bool used;
+        // Profiles not constrained by this field.
+        Bitmap any;
+        std::unordered_map<uint16_t, Bitmap> ports;
+        // Indexed by family (0 for IPv4, 1 for IPv6).
+        PrefixTrie prefixes[2];
+        Bitmap families[2];
+    };
+
+    enum {
+        FAMILY,
+        SRC_ADDRESS,
+        DST_ADDRESS,
+        EITHER_ADDRESS,
+        SRC_PORT,
+        DST_PORT,
+        EITHER_PORT,
+        DIMENSIONS,
+    };
+
+    size_t size_;
+    size_t words_;
+    size_t residual_count_;
+    Bitmap residual_;
+    Dimension dimensions_[DIMENSIONS];
+};
+
+#endif // _FILTER_INDEX_H_
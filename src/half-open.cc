@@ -0,0 +1,121 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#include "half-open.h"
+
+#include "connection.h"
+#include "io-backend.h"
+#include "log.h"
+
+HalfOpenTable::HalfOpenTable(State* state)
+    : state_(state),
+      promoted_(state->stats.counter("half_open.promoted")),
+      expired_(state->stats.counter("half_open.expired")),
+      aborted_(state->stats.counter("half_open.aborted")) {
+}
+
+HalfOpenTable::~HalfOpenTable() {
+    for (auto entry : table_v4_) {
+        delete entry.second;
+    }
+    for (auto entry : table_v6_) {
+        delete entry.second;
+    }
+}
+
+HalfOpenConnection* HalfOpenTable::find(const ConnectionKey& key, bool ipv4) {
+    if (ipv4) {
+        auto it = table_v4_.find(key.key_v4);
+        return it == table_v4_.end() ? NULL : it->second;
+    } else {
+        auto it = table_v6_.find(key.key_v6);
+        return it == table_v6_.end() ? NULL : it->second;
+    }
+}
+
+void HalfOpenTable::erase(const ConnectionKey& key, bool ipv4) {
+    HalfOpenConnection* connection = find(key, ipv4);
+
+    if (ipv4) {
+        table_v4_.erase(key.key_v4);
+    } else {
+        table_v6_.erase(key.key_v6);
+    }
+
+    connection->profile->admission()->half_open--;
+    delete connection;
+}
+
+void HalfOpenTable::add(Profile* profile, Packet* syn) {
+    ConnectionKey key;
+    ConnectionTable::connection_key_for_packet(&key, syn);
+
+    HalfOpenConnection* connection = new HalfOpenConnection(
+        profile, syn, ev_now(state_->loop), state_->timer_wheel,
+        [this] (HalfOpenConnection* connection) { expire(connection); });
+    HalfOpenConnection** slot;
+    if (syn->has_ipv4()) {
+        slot = &table_v4_[key.key_v4];
+    } else {
+        slot = &table_v6_[key.key_v6];
+    }
+    if (*slot) {
+        (*slot)->profile->admission()->half_open--;
+        delete *slot;
+    }
+    *slot = connection;
+    profile->admission()->half_open++;
+
+    connection->expiry_timer.reschedule(
+        state_->config.config().half_open_timeout());
+}
+
+bool HalfOpenTable::receive(Packet* p) {
+    ConnectionKey key;
+    ConnectionTable::connection_key_for_packet(&key, p);
+    bool ipv4 = p->has_ipv4();
+
+    HalfOpenConnection* connection = find(key, ipv4);
+    if (connection == NULL) {
+        return false;
+    }
+
+    bool from_client = p->from_iface_ == connection->syn.from_iface_;
+
+    if (from_client && p->tcp().syn() && !p->tcp().ack()) {
+        // Retransmit. Just pass it on.
+        p->from_iface_->other()->io()->inject(p);
+    } else if (!from_client && p->tcp().syn() && p->tcp().ack()) {
+        // The server responded, set up the real connection. It'll take
+        // care of the SYN-ACK from here on.
+        Connection* full = Connection::make(connection->profile,
+                                            &connection->syn,
+                                            state_,
+                                            connection->first_syn_timestamp);
+        erase(key, ipv4);
+        ++*promoted_;
+        full->receive(p);
+    } else if (p->tcp().rst()) {
+        p->from_iface_->other()->io()->inject(p);
+        erase(key, ipv4);
+        ++*aborted_;
+    } else {
+        // Getting packets that don't make sense for this handshake.
+        // Give up on the connection.
+        p->warn_summary("Handshake confusion, expected SYN-ACK from "
+                        "server. Bailing out");
+        erase(key, ipv4);
+        ++*aborted_;
+    }
+
+    return true;
+}
+
+void HalfOpenTable::expire(HalfOpenConnection* connection) {
+    ConnectionKey key;
+    ConnectionTable::connection_key_for_packet(&key, &connection->syn);
+    erase(key, connection->syn.has_ipv4());
+    ++*expired_;
+}
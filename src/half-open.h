@@ -0,0 +1,89 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#ifndef _HALF_OPEN_H_
+#define _HALF_OPEN_H_
+
+#include <cstdint>
+#include <functional>
+#include <map>
+
+#include "connection-table.h"
+#include "packet.h"
+#include "state.h"
+#include "timer-wheel.h"
+
+class Profile;
+
+// A connection for which we've seen a SYN but no SYN-ACK yet. This is
+// all the state we keep until the server responds; only then is the
+// connection promoted to a full Connection with timers, throttlers and
+// trace files. The SYN itself is forwarded without any impairment.
+struct HalfOpenConnection {
+    typedef std::function<void(HalfOpenConnection*)> Callback;
+
+    // "expire" is called with this connection when the expiry timer
+    // fires.
+    HalfOpenConnection(Profile* profile, Packet* syn, ev_tstamp now,
+                       TimerWheel* wheel, const Callback& expire)
+        : profile(profile),
+          syn(*syn),
+          first_syn_timestamp(now),
+          expiry_timer(wheel, [this, expire] (WheelTimer*) {
+                  expire(this);
+              }) {
+    }
+
+    Profile* profile;
+    // The original SYN, used for setting up the full connection.
+    Packet syn;
+    ev_tstamp first_syn_timestamp;
+    // Forgets the connection if the SYN-ACK doesn't arrive in time.
+    WheelTimer expiry_timer;
+};
+
+// Table of all half-open connections. Each has its own expiry timer on
+// the coarse timer wheel, so entries expire on time even if the timeout
+// is changed by a reload.
+class HalfOpenTable {
+public:
+    explicit HalfOpenTable(State* state);
+    ~HalfOpenTable();
+
+    // Number of half-open connections.
+    size_t size() {
+        return table_v4_.size() + table_v6_.size();
+    }
+
+    // Start tracking a new connection initiated by this SYN, using the
+    // specified profile.
+    void add(Profile* profile, Packet* syn);
+
+    // If this packet belongs to a half-open connection, handle it and
+    // return true. Otherwise return false.
+    bool receive(Packet* p);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(HalfOpenTable);
+
+    HalfOpenConnection* find(const ConnectionKey& key, bool ipv4);
+    // Remove the connection from the table, and delete it.
+    void erase(const ConnectionKey& key, bool ipv4);
+    // Forget about a connection that has been half-open for too long.
+    void expire(HalfOpenConnection* connection);
+
+    State* state_;
+
+    std::map<connection_key_v4, HalfOpenConnection*,
+             ConnectionKeyComparator<connection_key_v4> > table_v4_;
+    std::map<connection_key_v6, HalfOpenConnection*,
+             ConnectionKeyComparator<connection_key_v6> > table_v6_;
+
+    uint64_t* promoted_;
+    uint64_t* expired_;
+    uint64_t* aborted_;
+};
+
+#endif // _HALF_OPEN_H_
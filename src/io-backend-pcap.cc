@@ -3,7 +3,12 @@
  * Copyright 2012 Teclo Networks AG
  */
 
+#include <cerrno>
+#include <cstring>
+#include <linux/if_packet.h>
 #include <pcap.h>
+#include <sys/socket.h>
+#include <vector>
 
 #include "log.h"
 #include "io-backend.h"
@@ -21,7 +26,15 @@
 class IoBackendPcap : public IoBackend {
 public:
     IoBackendPcap(IoInterface* iface)
-        : IoBackend(iface), pcap_(NULL) {
+        : IoBackend(iface),
+          pcap_(NULL),
+          buffer_(kBatchSize * kFrameSize),
+          queued_(0) {
+        memset(messages_, 0, sizeof(messages_));
+        for (int i = 0; i < kBatchSize; ++i) {
+            messages_[i].msg_hdr.msg_iov = &iovecs_[i];
+            messages_[i].msg_hdr.msg_iovlen = 1;
+        }
     };
 
     virtual ~IoBackendPcap() {
@@ -41,7 +54,7 @@ public:
             return false;
         }
 
-        const int snaplen = 2048;
+        const int snaplen = kFrameSize;
 
         PCAP(pcap_, pcap_set_snaplen(pcap_, snaplen));
         PCAP(pcap_, pcap_set_timeout(pcap_, 0));
@@ -61,8 +74,8 @@ public:
         // - We'd like to buffer about 0.1s worth of data. No point in
         //   buffering any more than that. Ideally our normal latency
         //   is in the microsecond range, and with realtime priority
-        //   no disaster should cause a latency spike of more than a
-        //   few milliseconds.
+        //   (--realtime) no disaster should cause a latency spike of
+        //   more than a few milliseconds.
         PCAP(pcap_, pcap_set_buffer_size(pcap_, 8*1024*1024));
         PCAP(pcap_, pcap_activate(pcap_));
         PCAP(pcap_, pcap_setnonblock(pcap_, 1, errbuf));
@@ -71,12 +84,48 @@ public:
     }
 
     virtual void close() {
+        flush();
         pcap_close(pcap_);
         pcap_ = NULL;
     }
 
+    // Packets are copied into the batch, and only sent on flush() (or
+    // when the batch fills up).
     virtual bool inject(Packet* p) {
-        return pcap_inject(pcap_, (char*) p->ethh_, p->length_) == p->length_;
+        if (p->length_ > kFrameSize) {
+            flush();
+            return pcap_inject(pcap_, (char*) p->ethh_, p->length_) ==
+                (int) p->length_;
+        }
+
+        uint8_t* frame = &buffer_[queued_ * kFrameSize];
+        memcpy(frame, p->ethh_, p->length_);
+        iovecs_[queued_].iov_base = frame;
+        iovecs_[queued_].iov_len = p->length_;
+
+        if (++queued_ == kBatchSize) {
+            flush();
+        }
+        return true;
+    }
+
+    // Send the whole batch with one sendmmsg() on pcap's socket, which
+    // is what pcap_inject() would send() each packet on. Like a failed
+    // pcap_inject(), packets the kernel won't take are dropped.
+    virtual void flush() {
+        int sent = 0;
+        while (sent < queued_) {
+            int ret = sendmmsg(pcap_fileno(pcap_), messages_ + sent,
+                               queued_ - sent, 0);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            sent += ret;
+        }
+        queued_ = 0;
     }
 
     virtual bool receive(Packet* p) {
@@ -101,6 +150,28 @@ public:
         return true;
     }
 
+    virtual bool join_fanout(int group) {
+        // The kernel's fanout hash is symmetric, so both directions of
+        // a connection hash the same.
+        int arg = group |
+            ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+        if (setsockopt(pcap_fileno(pcap_), SOL_PACKET, PACKET_FANOUT,
+                       &arg, sizeof(arg)) < 0) {
+            warn_with_errno("setsockopt(PACKET_FANOUT)");
+            return false;
+        }
+        return true;
+    }
+
+    virtual bool set_busy_poll(int usec) {
+        if (setsockopt(pcap_fileno(pcap_), SOL_SOCKET, SO_BUSY_POLL,
+                       &usec, sizeof(usec)) < 0) {
+            warn_with_errno("setsockopt(SO_BUSY_POLL)");
+            return false;
+        }
+        return true;
+    }
+
     virtual int select_fd() const {
         return pcap_fileno(pcap_);
     }
@@ -119,7 +190,19 @@ public:
     }
 
 private:
+    // Packets to queue before sending them all with one system call.
+    static const int kBatchSize = 64;
+    // Space for each queued packet (the snaplen). Larger packets are
+    // sent right away.
+    static const size_t kFrameSize = 2048;
+
     pcap_t* pcap_;
+    // The queued packets, kFrameSize bytes each.
+    std::vector<uint8_t> buffer_;
+    struct mmsghdr messages_[kBatchSize];
+    struct iovec iovecs_[kBatchSize];
+    // Number of packets in the batch.
+    int queued_;
 };
 
 IoBackend* io_new_pcap(IoInterface* iface) {
@@ -33,7 +33,8 @@ public:
     // Write the contents of this raw ethernet packet into the interface.
     // The backing memory of the packet should either be returned by
     // receive(), or allocated with allocate_buffer() /
-    // allocate_inject_buffer().
+    // allocate_inject_buffer(). The backend may hold on to a copy of the
+    // packet until the next flush().
     virtual bool inject(Packet* p) = 0;
 
     // Receive a raw ethernet packet from the interface. The caller should
@@ -44,6 +45,20 @@ public:
     // Flush outbound packets.
     virtual void flush() { }
 
+    // Share the incoming packets of the interface with the other members
+    // of fanout group "group", by flow hash. Return false if that's not
+    // possible.
+    virtual bool join_fanout(int group) {
+        return false;
+    }
+
+    // Have the kernel busy poll the device queue for up to "usec"
+    // microseconds when there are no packets waiting (SO_BUSY_POLL).
+    // Return false if that's not possible.
+    virtual bool set_busy_poll(int usec) {
+        return false;
+    }
+
     // ** Misc.
 
     // Return a file descriptor that can be select()ed on to wait for
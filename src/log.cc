@@ -5,12 +5,20 @@
 
 #include "log.h"
 
+#include <algorithm>
 #include <errno.h>
 #include <inttypes.h>
+#include <mutex>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "spsc-ring.h"
 
 static bool syslog_enabled = false;
 
@@ -39,12 +47,517 @@ static void print_footer(const char* format) {
     }
 }
 
+// Write out a formatted info / warn message. "saved_errno" is -1 if
+// there's no error to describe.
+static void write_message(int level, const char* message, int saved_errno) {
+    print_header(level == LOG_INFO ? "Info" : "Warn", NULL, -1);
+    fputs(message, stderr);
+
+    if (saved_errno >= 0) {
+        char error[256];
+        if (!strerror_r(saved_errno, error, sizeof(error))) {
+            fprintf(stderr, " (%s)\n", error);
+        } else {
+            fprintf(stderr, " (%d)\n", saved_errno);
+        }
+    } else if (message[0]) {
+        print_footer(message);
+    } else {
+        fputc('\n', stderr);
+    }
+
+    if (syslog_enabled) {
+        syslog(level, "%s", message);
+    }
+}
+
+// Rate limiting
+
+static std::atomic<int> rate_limit(0);
+
+void set_log_rate_limit(int per_second) {
+    rate_limit = per_second > 0 ? per_second : 0;
+}
+
+static uint64_t current_second() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return now.tv_sec;
+}
+
+static void log_message(int level, const char* format, int saved_errno,
+                        bool wait, va_list ap);
+static void log_suppressed(int level, uint32_t count, const char* format);
+
+// Return true if a message from this site may be logged now.
+static bool allow(LogSite* site, int level, const char* format) {
+    int limit = rate_limit.load(std::memory_order_relaxed);
+    if (site == NULL || limit == 0) {
+        return true;
+    }
+
+    uint64_t now = current_second();
+    uint64_t window = site->window.load(std::memory_order_relaxed);
+    if (window != now &&
+        site->window.compare_exchange_strong(window, now)) {
+        site->count = 0;
+        uint32_t suppressed = site->suppressed.exchange(0);
+        if (suppressed) {
+            log_suppressed(level, suppressed, format);
+        }
+    }
+
+    if (site->count.fetch_add(1, std::memory_order_relaxed) <
+        static_cast<uint32_t>(limit)) {
+        return true;
+    }
+    site->suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+// Binary records
+//
+// In async mode, the logging thread doesn't format the message. It
+// copies the arguments, as described by the conversions in the format
+// string, into a record. The background thread formats the record by
+// walking the same format string again.
+
+enum ArgType {
+    ARG_NONE,
+    ARG_INT,
+    ARG_LONG,
+    ARG_LONG_LONG,
+    ARG_DOUBLE,
+    ARG_LONG_DOUBLE,
+    ARG_STRING,
+    ARG_POINTER,
+};
+
+struct Conversion {
+    // The whole conversion specification, e.g. "%-10.3s".
+    const char* begin;
+    const char* end;
+    ArgType type;
+    // Number of '*' width / precision arguments (ints) before the value.
+    int stars;
+};
+
+// Parse the conversion specification starting at "p" (just after the
+// '%').
+static void parse_conversion(const char* p, Conversion* c) {
+    c->begin = p - 1;
+    c->stars = 0;
+
+    while (*p && strchr("-+ #0'", *p)) {
+        ++p;
+    }
+    for (; *p == '*' || (*p >= '0' && *p <= '9'); ++p) {
+        c->stars += *p == '*';
+    }
+    if (*p == '.') {
+        for (++p; *p == '*' || (*p >= '0' && *p <= '9'); ++p) {
+            c->stars += *p == '*';
+        }
+    }
+
+    int longs = 0;
+    bool size = false;
+    bool long_double = false;
+    for (; *p && strchr("hlLqjzt", *p); ++p) {
+        longs += *p == 'l';
+        longs += 2 * (*p == 'q');
+        size |= *p == 'j' || *p == 'z' || *p == 't';
+        long_double |= *p == 'L';
+    }
+
+    switch (*p) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        if (longs >= 2) {
+            c->type = ARG_LONG_LONG;
+        } else if (longs == 1 || size) {
+            c->type = ARG_LONG;
+        } else {
+            c->type = ARG_INT;
+        }
+        break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a':
+    case 'A':
+        c->type = long_double ? ARG_LONG_DOUBLE : ARG_DOUBLE;
+        break;
+    case 's':
+        c->type = ARG_STRING;
+        break;
+    case 'p':
+        c->type = ARG_POINTER;
+        break;
+    default:
+        // "%%", or something we don't know how to copy.
+        c->type = ARG_NONE;
+        break;
+    }
+    c->end = *p ? p + 1 : p;
+}
+
+static const size_t kRecordSize = 256;
+
+struct LogRecord {
+    // NULL if the message was formatted by the caller, because the
+    // arguments didn't fit (or weren't understood).
+    const char* format;
+    int level;
+    int saved_errno;
+    uint32_t length;
+    uint8_t data[kRecordSize - sizeof(const char*) - 3 * sizeof(int)];
+};
+
+template<class T>
+static bool pack(uint8_t* data, size_t size, size_t* pos, T value) {
+    if (*pos + sizeof(value) > size) {
+        return false;
+    }
+    memcpy(data + *pos, &value, sizeof(value));
+    *pos += sizeof(value);
+    return true;
+}
+
+template<class T>
+static T unpack(const uint8_t* data, size_t* pos) {
+    T value;
+    memcpy(&value, data + *pos, sizeof(value));
+    *pos += sizeof(value);
+    return value;
+}
+
+// Copy the arguments of the message into the record. Return false if
+// they don't fit.
+static bool pack_args(LogRecord* record, va_list ap) {
+    uint8_t* data = record->data;
+    const size_t size = sizeof(record->data);
+    size_t pos = 0;
+
+    for (const char* p = record->format; *p; ++p) {
+        if (*p != '%') {
+            continue;
+        }
+        Conversion c;
+        parse_conversion(p + 1, &c);
+        p = c.end - 1;
+
+        for (int i = 0; i < c.stars; ++i) {
+            if (!pack(data, size, &pos, va_arg(ap, int))) {
+                return false;
+            }
+        }
+
+        bool ok = true;
+        switch (c.type) {
+        case ARG_NONE:
+            if (c.end - c.begin != 2 || c.begin[1] != '%') {
+                return false;
+            }
+            break;
+        case ARG_INT:
+            ok = pack(data, size, &pos, va_arg(ap, int));
+            break;
+        case ARG_LONG:
+            ok = pack(data, size, &pos, va_arg(ap, long));
+            break;
+        case ARG_LONG_LONG:
+            ok = pack(data, size, &pos, va_arg(ap, long long));
+            break;
+        case ARG_DOUBLE:
+            ok = pack(data, size, &pos, va_arg(ap, double));
+            break;
+        case ARG_LONG_DOUBLE:
+            ok = pack(data, size, &pos, va_arg(ap, long double));
+            break;
+        case ARG_POINTER:
+            ok = pack(data, size, &pos, va_arg(ap, void*));
+            break;
+        case ARG_STRING: {
+            const char* s = va_arg(ap, const char*);
+            if (s == NULL) {
+                s = "(null)";
+            }
+            size_t length = strlen(s) + 1;
+            if (pos + length > size) {
+                return false;
+            }
+            memcpy(data + pos, s, length);
+            pos += length;
+            break;
+        }
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+
+    record->length = pos;
+    return true;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+
+template<class T>
+static int format_value(char* out, size_t size, const char* spec,
+                        int stars, const int* star_values, T value) {
+    switch (stars) {
+    case 0:
+        return snprintf(out, size, spec, value);
+    case 1:
+        return snprintf(out, size, spec, star_values[0], value);
+    default:
+        return snprintf(out, size, spec, star_values[0], star_values[1],
+                        value);
+    }
+}
+
+#pragma GCC diagnostic pop
+
+// Format a packed record into "out".
+static void format_record(const LogRecord* record, char* out, size_t size) {
+    if (record->format == NULL) {
+        snprintf(out, size, "%s", reinterpret_cast<const char*>(record->data));
+        return;
+    }
+
+    size_t pos = 0;
+    size_t used = 0;
+    for (const char* p = record->format; *p && used + 1 < size; ++p) {
+        if (*p != '%') {
+            out[used++] = *p;
+            continue;
+        }
+        Conversion c;
+        parse_conversion(p + 1, &c);
+        p = c.end - 1;
+
+        char spec[32];
+        size_t spec_length = c.end - c.begin;
+        if (spec_length >= sizeof(spec)) {
+            spec_length = sizeof(spec) - 1;
+        }
+        memcpy(spec, c.begin, spec_length);
+        spec[spec_length] = 0;
+
+        int star_values[2] = { 0, 0 };
+        for (int i = 0; i < c.stars; ++i) {
+            int value = unpack<int>(record->data, &pos);
+            if (i < 2) {
+                star_values[i] = value;
+            }
+        }
+
+        char* dest = out + used;
+        size_t left = size - used;
+        int n = 0;
+        switch (c.type) {
+        case ARG_NONE:
+            n = snprintf(dest, left, "%%");
+            break;
+        case ARG_INT:
+            n = format_value(dest, left, spec, c.stars, star_values,
+                             unpack<int>(record->data, &pos));
+            break;
+        case ARG_LONG:
+            n = format_value(dest, left, spec, c.stars, star_values,
+                             unpack<long>(record->data, &pos));
+            break;
+        case ARG_LONG_LONG:
+            n = format_value(dest, left, spec, c.stars, star_values,
+                             unpack<long long>(record->data, &pos));
+            break;
+        case ARG_DOUBLE:
+            n = format_value(dest, left, spec, c.stars, star_values,
+                             unpack<double>(record->data, &pos));
+            break;
+        case ARG_LONG_DOUBLE:
+            n = format_value(dest, left, spec, c.stars, star_values,
+                             unpack<long double>(record->data, &pos));
+            break;
+        case ARG_POINTER:
+            n = format_value(dest, left, spec, c.stars, star_values,
+                             unpack<void*>(record->data, &pos));
+            break;
+        case ARG_STRING: {
+            const char* s = reinterpret_cast<const char*>(record->data + pos);
+            pos += strlen(s) + 1;
+            n = format_value(dest, left, spec, c.stars, star_values, s);
+            break;
+        }
+        }
+        if (n > 0) {
+            used += std::min(static_cast<size_t>(n), left - 1);
+        }
+    }
+    out[used] = 0;
+}
+
+// Async mode
+
+typedef SpscRing<LogRecord> LogRing;
+
+static const size_t kRingSize = 1024;
+// How often the background thread looks for new messages.
+static const useconds_t kDrainIntervalUs = 10000;
+// How often a thread waiting for room in its ring retries.
+static const useconds_t kWaitIntervalUs = 100;
+
+static std::atomic<bool> async_enabled(false);
+static std::atomic<bool> async_stopping(false);
+static std::atomic<uint64_t> async_dropped(0);
+static std::thread* async_thread = NULL;
+// Rings of all threads that have logged. Never freed, since threads
+// might log until the very end.
+static std::mutex rings_mutex;
+static std::vector<LogRing*> rings;
+static thread_local LogRing* thread_ring = NULL;
+
+static LogRing* ring_for_thread() {
+    if (thread_ring == NULL) {
+        thread_ring = new LogRing(kRingSize);
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        rings.push_back(thread_ring);
+    }
+    return thread_ring;
+}
+
+// Write out all pending records. Return true if there were any.
+static bool drain_rings() {
+    std::vector<LogRing*> current;
+    {
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        current = rings;
+    }
+    bool any = false;
+    LogRecord record;
+    char message[4096];
+
+    for (LogRing* ring : current) {
+        while (ring->pop(&record)) {
+            format_record(&record, message, sizeof(message));
+            write_message(record.level, message, record.saved_errno);
+            any = true;
+        }
+    }
+
+    uint64_t dropped = async_dropped.exchange(0);
+    if (dropped) {
+        snprintf(message, sizeof(message),
+                 "%" PRIu64 " log messages dropped", dropped);
+        write_message(LOG_WARNING, message, -1);
+    }
+    return any;
+}
+
+static void stop_async_log() {
+    async_stopping = true;
+    async_thread->join();
+    drain_rings();
+}
+
+void use_async_log() {
+    if (async_enabled.exchange(true)) {
+        return;
+    }
+    async_thread = new std::thread([] () {
+            while (!async_stopping) {
+                if (!drain_rings()) {
+                    usleep(kDrainIntervalUs);
+                }
+            }
+        });
+    atexit(stop_async_log);
+}
+
+void flush_log() {
+    if (!async_enabled) {
+        return;
+    }
+    // The rings can only be emptied by their consumer, so wait for the
+    // background thread to get to them.
+    for (int i = 0; i < 100; ++i) {
+        bool empty = true;
+        {
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            for (LogRing* ring : rings) {
+                empty &= ring->empty();
+            }
+        }
+        if (empty) {
+            break;
+        }
+        usleep(kDrainIntervalUs);
+    }
+    fflush(stderr);
+}
+
+// Log a message. If the thread's ring is full, either wait for the
+// background thread to make room or drop the message.
+static void log_message(int level, const char* format, int saved_errno,
+                        bool wait, va_list ap) {
+    LogRecord record;
+    record.format = format;
+    record.level = level;
+    record.saved_errno = saved_errno;
+
+    if (!async_enabled.load(std::memory_order_relaxed) || async_stopping) {
+        char message[4096];
+        vsnprintf(message, sizeof(message), format, ap);
+        write_message(level, message, saved_errno);
+        return;
+    }
+
+    va_list aq;
+    va_copy(aq, ap);
+    if (!pack_args(&record, aq)) {
+        record.format = NULL;
+        vsnprintf(reinterpret_cast<char*>(record.data), sizeof(record.data),
+                  format, ap);
+    }
+    va_end(aq);
+
+    LogRing* ring = ring_for_thread();
+    if (ring->push(record)) {
+        return;
+    }
+    if (!wait) {
+        async_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    while (!ring->push(record)) {
+        if (async_stopping) {
+            // Nobody is going to empty the ring any more.
+            char message[4096];
+            format_record(&record, message, sizeof(message));
+            write_message(level, message, saved_errno);
+            return;
+        }
+        usleep(kWaitIntervalUs);
+    }
+}
+
+static void log_formatted(int level, const char* format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    log_message(level, format, -1, false, ap);
+    va_end(ap);
+}
+
+static void log_suppressed(int level, uint32_t count, const char* format) {
+    log_formatted(level, "%u more messages suppressed: %s", count, format);
+}
+
 void fail(const char *format, ...)
 {
     va_list ap, aq;
     va_start(ap, format);
     va_copy(aq, ap);
 
+    flush_log();
     print_header("Fail", NULL, -1);
     vfprintf(stderr, format, ap);
     print_footer(format);
@@ -68,6 +581,7 @@ void fail_with_errno(const char *format, ...)
     va_start(ap, format);
     va_copy(aq, ap);
 
+    flush_log();
     print_header("Fail", NULL, -1);
     vfprintf(stderr, format, ap);
 
@@ -94,6 +608,7 @@ void fail_with_srcloc(const char *file, int line, const char* format, ...)
     va_start(ap, format);
     va_copy(aq, ap);
 
+    flush_log();
     print_header("Fail", file, line);
     vfprintf(stderr, format, ap);
     print_footer(format);
@@ -109,64 +624,41 @@ void fail_with_srcloc(const char *file, int line, const char* format, ...)
 
 }
 
-void warn(const char *format, ...)
+void log_warn(LogSite* site, const char *format, ...)
 {
-    va_list ap, aq;
-    va_start(ap, format);
-    va_copy(aq, ap);
-
-    print_header("Warn", NULL, -1);
-    vfprintf(stderr, format, ap);
-    print_footer(format);
-
-    if (syslog_enabled) {
-        vsyslog(LOG_WARNING, format, aq);
+    if (!allow(site, LOG_WARNING, format)) {
+        return;
     }
 
-    va_end(aq);
+    va_list ap;
+    va_start(ap, format);
+    log_message(LOG_WARNING, format, -1, site == NULL, ap);
     va_end(ap);
 }
 
-void warn_with_errno(const char *format, ...)
+void log_warn_with_errno(LogSite* site, const char *format, ...)
 {
     int orig_errno = errno;
 
-    va_list ap, aq;
-    va_start(ap, format);
-    va_copy(aq, ap);
-
-    print_header("Warn", NULL, -1);
-    vfprintf(stderr, format, ap);
-
-    if (syslog_enabled) {
-        vsyslog(LOG_WARNING, format, aq);
+    if (!allow(site, LOG_WARNING, format)) {
+        return;
     }
 
-    va_end(aq);
+    va_list ap;
+    va_start(ap, format);
+    log_message(LOG_WARNING, format, orig_errno, site == NULL, ap);
     va_end(ap);
-
-    char error[256];
-    if (!strerror_r(orig_errno, error, sizeof(error))) {
-        fprintf(stderr, " (%s)\n", error);
-    } else {
-        fprintf(stderr, " (%d)\n", orig_errno);
-    }
 }
 
-void info(const char *format, ...)
+void log_info(LogSite* site, const char *format, ...)
 {
-    va_list ap, aq;
-    va_start(ap, format);
-    va_copy(aq, ap);
-    print_header("Info", NULL, -1);
-    vfprintf(stderr, format, ap);
-    print_footer(format);
-
-    if (syslog_enabled) {
-        vsyslog(LOG_INFO, format, aq);
+    if (!allow(site, LOG_INFO, format)) {
+        return;
     }
 
-    va_end(aq);
+    va_list ap;
+    va_start(ap, format);
+    log_message(LOG_INFO, format, -1, site == NULL, ap);
     va_end(ap);
 }
 
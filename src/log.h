@@ -7,18 +7,53 @@
 #define _LOG_H_
 
 #include <errno.h>
+#include <atomic>
 #include <cstdarg>
 #include <cstdbool>
+#include <cstdint>
 
 #include "attributes.h"
 
+// State for rate limiting the messages logged from one call site.
+struct LogSite {
+    // The second the current count is for.
+    std::atomic<uint64_t> window;
+    std::atomic<uint32_t> count;
+    std::atomic<uint32_t> suppressed;
+};
+
 void use_syslog(const char *ident, bool include_pid);
+// From now on, format and write info / warn messages on a background
+// thread. The logging thread only copies the format string pointer and
+// the arguments into a ring of its own.
+void use_async_log();
+// Wait (briefly) for the background thread to write out all pending
+// messages.
+void flush_log();
+// Log at most this many messages per second from each call site. 0 for
+// no limit.
+void set_log_rate_limit(int per_second);
+
 void fail(const char *format, ...) CHECK_PRINTF_ARGS NO_RETURN;
 void fail_with_errno(const char *format, ...) CHECK_PRINTF_ARGS NO_RETURN;
 void fail_with_srcloc(const char *file, int line, const char *format, ...) NO_RETURN;
-void warn(const char *format, ...) CHECK_PRINTF_ARGS;
-void warn_with_errno(const char *format, ...) CHECK_PRINTF_ARGS;
-void info(const char *format, ...) CHECK_PRINTF_ARGS;
+
+// The format must be a string literal (or otherwise live forever). A
+// NULL site is never rate limited, and its messages are never dropped
+// when the background thread falls behind; the caller waits instead.
+void log_warn(LogSite* site, const char *format, ...) CHECK_SITE_PRINTF_ARGS;
+void log_warn_with_errno(LogSite* site, const char *format, ...)
+    CHECK_SITE_PRINTF_ARGS;
+void log_info(LogSite* site, const char *format, ...) CHECK_SITE_PRINTF_ARGS;
+
+#define LOG_AT_SITE(function, ...) do {                 \
+        static LogSite log_site_;                       \
+        function(&log_site_, __VA_ARGS__);              \
+    } while (0)
+
+#define warn(...)            LOG_AT_SITE(log_warn, __VA_ARGS__)
+#define warn_with_errno(...) LOG_AT_SITE(log_warn_with_errno, __VA_ARGS__)
+#define info(...)            LOG_AT_SITE(log_info, __VA_ARGS__)
 
 extern bool need_fresh_line;
 bool fresh_line(void);
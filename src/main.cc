@@ -7,116 +7,143 @@
 #include <memory>
 #include <vector>
 
-#include "connection.h"
-#include "connection-table.h"
-#include "iface.h"
-#include "io-backend.h"
+#include "config-loader.h"
 #include "log.h"
+#include "realtime.h"
 #include "state.h"
+#include "worker.h"
 
 DEFINE_string(config, "", "Name of configuration file (required)");
 DEFINE_string(downlink_iface, "",
               "Name of downlink network interface (required)");
 DEFINE_string(uplink_iface, "", "Name of uplink network interface (required)");
-
-State state;
-
-static void handle_tcp(Packet* p) {
-    Connection* connection = state.connections->get_connection_for_packet(p);
-
-    if (!connection) {
-        if (p->tcp().syn() && !p->tcp().ack()) {
-            for (auto profile : state.config.profiles_by_priority()) {
-                if (profile->filter()->packet_matches_filter(p)) {
-                    connection = Connection::make(profile, p, &state);
-                    return;
-                }
-            }
-        }
-
-        p->from_iface_->other()->io()->inject(p);
-        return;
-    } else {
-        connection->receive(p);
-    }
-}
-
-static void handle_packet(struct ev_loop *loop, ev_io *w, int revents) {
-    IoBackend* io = reinterpret_cast<struct libev_watcher<ev_io, IoBackend*>*>(w)->payload;
-
-    Packet p;
-
-    while (revents--) {
-        if (!io->receive(&p)) {
-            return;
-        }
-
-        if (p.has_tcp()) {
-            handle_tcp(&p);
-        } else {
-            // Forward all other packets straight through
-            p.from_iface_->other()->io()->inject(&p);
-        }
-
-        p.release();
-    }
-}
-
-void reload_config() {
-    if (!FLAGS_config.empty()) {
-        info("Loading configuration from %s", FLAGS_config.c_str());
-        if (!state.config.update(FLAGS_config)) {
-            fail("Failed to read config during initial startup, quitting\n");
-        }
-    }
-}
+DEFINE_string(stats_file, "",
+              "If set, periodically write statistics to this file");
+DEFINE_double(stats_interval, 10.0,
+              "Interval (in seconds) for writing statistics");
+DEFINE_bool(precision_pacing, false,
+            "Schedule packet departures with nanosecond ticks, and wake "
+            "up for them from a timerfd instead of libev's millisecond "
+            "timers");
+DEFINE_double(pacing_spin_us, 50,
+              "In precision pacing mode, busy-wait for up to this many "
+              "microseconds before each departure");
+DEFINE_int32(delay_line_mb, 0,
+             "Size of the store for packets in long delay queues, in "
+             "megabytes. 0 to keep all delayed packets on the heap.");
+DEFINE_string(delay_line_file, "",
+              "If set, back the delay line store by this file.");
+DEFINE_bool(delay_line_hugepages, false,
+            "Put the delay line store on huge pages.");
+DEFINE_int32(delay_line_spill_above, 64,
+             "Spill packets to the delay line store once a connection has "
+             "this many packets in its delay queue.");
+
+DEFINE_bool(pipeline, false,
+            "Receive and send packets on a separate thread for each "
+            "interface, leaving the event loop thread free for emulation");
+DEFINE_int32(workers, 1,
+             "Number of threads to spread the connections between");
+DEFINE_int32(downlink_iface_budget, 64,
+             "Packets to handle from the downlink interface per event "
+             "loop iteration");
+DEFINE_int32(uplink_iface_budget, 64,
+             "Packets to handle from the uplink interface per event loop "
+             "iteration");
+DEFINE_int32(timer_budget, 256,
+             "Timers to run per event loop iteration (per timer wheel), "
+             "0 for no limit");
+DEFINE_int32(busy_poll_us, 0,
+             "Spin on the interfaces instead of sleeping until this many "
+             "microseconds have passed without packets. 0 to always "
+             "sleep.");
+DEFINE_int32(so_busy_poll_us, 0,
+             "Have the kernel busy poll the network device for up to this "
+             "many microseconds when reading from an empty socket "
+             "(SO_BUSY_POLL)");
+DEFINE_bool(realtime, false,
+            "Run the packet processing threads at real-time priority, "
+            "and lock all memory");
+DEFINE_int32(rt_priority, 50,
+             "In real-time mode, the SCHED_FIFO priority of the packet "
+             "processing threads");
+DEFINE_string(rt_cpus, "",
+              "In real-time mode, CPUs (e.g. '2,4-7') to pin the packet "
+              "processing threads to, one per thread");
+DEFINE_int32(rt_prefault_heap_mb, 64,
+             "In real-time mode, megabytes of heap to fault in at startup");
+DEFINE_bool(bpf_jit, true,
+            "Compile profile filters to native code (x86-64 only)");
+DEFINE_bool(verify_bpf_jit, false,
+            "Check the native code of each filter against the interpreter "
+            "for every packet (slow)");
+DEFINE_bool(async_log, true,
+            "Write log messages from a background thread, so that a slow "
+            "stderr can't hold up packet processing");
+DEFINE_int32(log_rate_limit, 10,
+             "Log at most this many messages per second from each place "
+             "in the code. 0 for no limit.");
 
 int main(int argc, char** argv) {
     google::SetUsageMessage("flow-disruptor [flags]");
     google::ParseCommandLineFlags(&argc, &argv, true);
 
-    reload_config();
-
-    IoInterface downlink_iface(FLAGS_downlink_iface, IoInterface::DOWNLINK);
-    IoInterface uplink_iface(FLAGS_uplink_iface, IoInterface::UPLINK);
-
-    downlink_iface.set_other(&uplink_iface);
-    uplink_iface.set_other(&downlink_iface);
-
-    std::vector<IoBackend*> ios;
-
-    ios.push_back(io_new_pcap(&downlink_iface));
-    ios.push_back(io_new_pcap(&uplink_iface));
+    set_log_rate_limit(FLAGS_log_rate_limit);
+    if (FLAGS_async_log) {
+        use_async_log();
+    }
+    realtime_init();
 
-    std::vector<struct libev_watcher<ev_io, IoBackend*>*> io_watchers;
+    if (FLAGS_workers < 1) {
+        fail("--workers must be at least 1");
+    }
 
-    for (auto io : ios) {
-        if (!io->open()) {
-            fail("Could not open interface: '%s'", io->iface()->name().c_str());
-        }
+    std::vector<std::unique_ptr<Worker> > workers;
+    for (int i = 0; i < FLAGS_workers; ++i) {
+        workers.emplace_back(new Worker(i, FLAGS_workers));
+    }
 
-        int fd = io->select_fd();
-        if (fd >= 0) {
-            auto watcher = new libev_watcher<ev_io, IoBackend*>();
-            watcher->payload = io;
-            io_watchers.push_back(watcher);
-            ev_io_init(&watcher->watcher, handle_packet, fd, EV_READ);
-            ev_io_start(state.loop, &watcher->watcher);
-        }
+    ConfigLoader loader(FLAGS_config, FLAGS_workers,
+                        [&workers] (std::shared_ptr<const ConfigSnapshot> c) {
+                            for (auto& worker : workers) {
+                                worker->publish_config(c);
+                            }
+                        });
+    std::shared_ptr<const ConfigSnapshot> config = loader.load();
+    if (!config) {
+        fail("Failed to read config during initial startup, quitting\n");
+    }
+    for (auto& worker : workers) {
+        worker->init(config);
     }
 
-    SignalHandler sigint_handler(&state,
-                                 [] () {
-                                     ev_unloop(state.loop, EVUNLOOP_ALL);
+    // Signals are handled on the first worker's (default) loop, and
+    // passed on to all of them.
+    State* state = workers[0]->state();
+    SignalHandler sigint_handler(state,
+                                 [&workers] () {
+                                     for (auto& worker : workers) {
+                                         worker->request_stop();
+                                     }
                                  },
                                  SIGINT);
-    SignalHandler sighup_handler(&state, &reload_config, SIGHUP);
-
-    ev_run(state.loop, 0);
-
-    for (auto io : ios) {
-        io->close();
-        delete io;
+    SignalHandler sighup_handler(state,
+                                 [&loader] () { loader.request(); },
+                                 SIGHUP);
+    SignalHandler sigusr1_handler(state,
+                                  [&workers] () {
+                                      for (auto& worker : workers) {
+                                          worker->request_stats();
+                                      }
+                                  },
+                                  SIGUSR1);
+
+    for (size_t i = 1; i < workers.size(); ++i) {
+        workers[i]->start();
+    }
+    workers[0]->run();
+    for (size_t i = 1; i < workers.size(); ++i) {
+        workers[i]->join();
     }
 
     return EXIT_SUCCESS;
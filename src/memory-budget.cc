@@ -0,0 +1,61 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#include "memory-budget.h"
+
+MemoryBudget::MemoryBudget(Stats* stats)
+    : stats_(stats),
+      used_(0),
+      used_by_category_(),
+      dropped_packets_(stats->counter("memory.dropped_packets")) {
+    static const char* const kNames[kCategories] = {
+        "throttler_queue",
+        "shared_queue",
+        "delay_queue",
+        "capture_buffer",
+    };
+
+    stats->add_gauge("memory.bytes", [this] () { return used_; });
+    stats->add_gauge("memory.max_bytes", [this] () {
+            return limits_.max_bytes();
+        });
+    for (int i = 0; i < kCategories; ++i) {
+        stats->add_gauge(std::string("memory.") + kNames[i] + "_bytes",
+                         [this, i] () { return used_by_category_[i]; });
+    }
+}
+
+void MemoryBudget::update(const MemoryLimits& limits) {
+    limits_.CopyFrom(limits);
+}
+
+bool MemoryBudget::charge(MemoryAccount* account, Category category,
+                          uint64_t bytes) {
+    if (limits_.max_bytes() && used_ + bytes > limits_.max_bytes()) {
+        return false;
+    }
+
+    used_ += bytes;
+    used_by_category_[category] += bytes;
+    for (; account; account = account->parent) {
+        account->bytes += bytes;
+    }
+    return true;
+}
+
+void MemoryBudget::release(MemoryAccount* account, Category category,
+                           uint64_t bytes) {
+    used_ -= bytes;
+    used_by_category_[category] -= bytes;
+    for (; account; account = account->parent) {
+        account->bytes -= bytes;
+    }
+}
+
+bool MemoryBudget::refusing_connections() const {
+    return limits_.overflow_policy() == MemoryLimits::REFUSE_CONNECTIONS &&
+        limits_.max_bytes() &&
+        used_ > limits_.max_bytes() * limits_.refuse_connections_above();
+}
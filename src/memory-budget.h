@@ -0,0 +1,105 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+// A process-wide limit on the memory used for buffering packets. Every
+// queue that holds packets charges them to the budget, on behalf of the
+// flow (and through it, the profile) the packets belong to.
+
+#ifndef _MEMORY_BUDGET_H_
+#define _MEMORY_BUDGET_H_
+
+#include <cstdint>
+#include <string>
+
+#include "base.h"
+#include "FlowDisruptorConfig.pb.h"
+#include "packet.h"
+#include "stats.h"
+
+// Memory used by one flow or profile. Charges to an account are also
+// charged to its parent.
+struct MemoryAccount {
+    explicit MemoryAccount(MemoryAccount* parent)
+        : parent(parent),
+          bytes(0) {
+    }
+
+    MemoryAccount* parent;
+    uint64_t bytes;
+};
+
+class MemoryBudget {
+public:
+    // What the memory is used for.
+    enum Category {
+        THROTTLER_QUEUE,
+        SHARED_QUEUE,
+        DELAY_QUEUE,
+        CAPTURE_BUFFER,
+        kCategories,
+    };
+
+    explicit MemoryBudget(Stats* stats);
+
+    // Apply these limits (on startup and configuration reload).
+    void update(const MemoryLimits& limits);
+
+    // Account for "bytes" more memory. Return false, without charging
+    // anything, if that would go over the budget.
+    bool charge(MemoryAccount* account, Category category, uint64_t bytes);
+    // Undo a charge.
+    void release(MemoryAccount* account, Category category, uint64_t bytes);
+
+    // Charge for a packet that's about to be queued. If it doesn't fit
+    // and the policy is to drop the oldest packets, call "drop_oldest"
+    // until it does. That should drop the oldest packet of the queue
+    // (releasing its memory), or return false if the queue is empty.
+    // Return false if the new packet should be dropped.
+    template<class DropOldest>
+    bool charge_packet(MemoryAccount* account, Category category,
+                       const Packet* p, DropOldest drop_oldest) {
+        while (!charge(account, category, packet_memory(p))) {
+            ++*dropped_packets_;
+            if (limits_.overflow_policy() != MemoryLimits::DROP_OLDEST ||
+                !drop_oldest()) {
+                return false;
+            }
+        }
+        return true;
+    }
+    void release_packet(MemoryAccount* account, Category category,
+                        const Packet* p) {
+        release(account, category, packet_memory(p));
+    }
+    // Release everything in this queue (e.g. before deleting it).
+    template<class Queue>
+    void release_queue(MemoryAccount* account, Category category,
+                       const Queue& queue) {
+        release(account, category,
+                queue.bytes() + queue.size() * sizeof(Packet));
+    }
+
+    // Memory used by a packet that's been detached from the receive
+    // buffer.
+    static uint64_t packet_memory(const Packet* p) {
+        return sizeof(Packet) + p->length_;
+    }
+
+    // True if new connections should be refused due to memory pressure.
+    bool refusing_connections() const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(MemoryBudget);
+
+    Stats* stats_;
+    MemoryLimits limits_;
+
+    uint64_t used_;
+    uint64_t used_by_category_[kCategories];
+
+    uint64_t* dropped_packets_;
+};
+
+#endif // _MEMORY_BUDGET_H_
@@ -0,0 +1,80 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#ifndef _PACKET_QUEUE_H_
+#define _PACKET_QUEUE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "base.h"
+#include "packet.h"
+
+// A FIFO of packets, linked through the packets themselves (so queueing
+// never allocates). Owns the packets in the queue.
+class PacketQueue {
+public:
+    PacketQueue()
+        : head_(NULL),
+          tail_(NULL),
+          size_(0),
+          bytes_(0) {
+    }
+
+    ~PacketQueue() {
+        clear();
+    }
+
+    bool empty() const { return head_ == NULL; }
+    // Number of packets in the queue.
+    size_t size() const { return size_; }
+    // Total length of the packets in the queue.
+    uint64_t bytes() const { return bytes_; }
+
+    Packet* front() const { return head_; }
+
+    void push_back(Packet* p) {
+        p->next_ = NULL;
+        if (tail_) {
+            tail_->next_ = p;
+        } else {
+            head_ = p;
+        }
+        tail_ = p;
+        ++size_;
+        bytes_ += p->length_;
+    }
+
+    // Remove the first packet from the queue, and return it. The caller
+    // takes ownership.
+    Packet* pop_front() {
+        Packet* p = head_;
+        head_ = p->next_;
+        if (head_ == NULL) {
+            tail_ = NULL;
+        }
+        p->next_ = NULL;
+        --size_;
+        bytes_ -= p->length_;
+        return p;
+    }
+
+    // Delete all packets in the queue.
+    void clear() {
+        while (!empty()) {
+            delete pop_front();
+        }
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(PacketQueue);
+
+    Packet* head_;
+    Packet* tail_;
+    size_t size_;
+    uint64_t bytes_;
+};
+
+#endif // _PACKET_QUEUE_H_
@@ -11,7 +11,9 @@ Packet::Packet(const Packet& other)
     : PacketHeader(other),
       length_(other.length_),
       from_iface_(other.from_iface_),
-      ethh_(NULL) {
+      ethh_(NULL),
+      next_(NULL),
+      timestamp_(other.timestamp_) {
     if (other.ethh_) {
         uint8_t* buf = (uint8_t*) malloc(length_);
         memcpy(buf, other.ethh_, length_);
@@ -30,6 +32,19 @@ void Packet::release() {
     }
 }
 
+Packet* Packet::detach() {
+    Packet* copy = new Packet();
+
+    copy->Swap(this);
+    copy->length_ = length_;
+    copy->from_iface_ = from_iface_;
+    copy->ethh_ = ethh_;
+    copy->timestamp_ = timestamp_;
+    ethh_ = NULL;
+
+    return copy;
+}
+
 bool Packet::init(uint8_t* frame, size_t length, IoInterface* from_iface) {
     const int network_order_ether_vlan = htons(PKT_ETHER_VLAN);
     const int network_order_ether_ip = htons(PKT_ETHER_TYPE_IP);
@@ -192,3 +207,35 @@ bool Packet::parse_tcp(pkt_tcp_t* tcph, size_t length) {
 
     return true;
 }
+
+void Packet::warn_summary(const char* reason) const {
+    const TCPHeader& t = tcp();
+
+    if (has_ipv4()) {
+        uint32_t s = ipv4().saddr(0);
+        uint32_t d = ipv4().daddr(0);
+        warn("%s: %u.%u.%u.%u:%u > %u.%u.%u.%u:%u [%s%s%s%s] "
+             "seq %u ack %u\n",
+             reason,
+             s >> 24, (s >> 16) & 0xff, (s >> 8) & 0xff, s & 0xff,
+             t.source_port(),
+             d >> 24, (d >> 16) & 0xff, (d >> 8) & 0xff, d & 0xff,
+             t.dest_port(),
+             t.syn() ? "S" : "", t.fin() ? "F" : "", t.rst() ? "R" : "",
+             t.ack() ? "." : "", t.seq(), t.ack_seq());
+    } else if (has_ipv6() && ipv6().saddr_size() == 4 &&
+               ipv6().daddr_size() == 4) {
+        const IPHeader& ip = ipv6();
+        warn("%s: [%08x%08x%08x%08x]:%u > [%08x%08x%08x%08x]:%u "
+             "[%s%s%s%s] seq %u ack %u\n",
+             reason,
+             ip.saddr(0), ip.saddr(1), ip.saddr(2), ip.saddr(3),
+             t.source_port(),
+             ip.daddr(0), ip.daddr(1), ip.daddr(2), ip.daddr(3),
+             t.dest_port(),
+             t.syn() ? "S" : "", t.fin() ? "F" : "", t.rst() ? "R" : "",
+             t.ack() ? "." : "", t.seq(), t.ack_seq());
+    } else {
+        warn("%s: non-IP packet\n", reason);
+    }
+}
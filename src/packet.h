@@ -22,7 +22,7 @@ enum buffer_owner {
 // Collection of pointers that make up a TCP packet
 class Packet : public PacketHeader {
 public:
-    Packet() : ethh_(NULL) {
+    Packet() : ethh_(NULL), next_(NULL), timestamp_(0) {
     }
 
     Packet(const Packet& other);
@@ -32,6 +32,16 @@ public:
     bool init(uint8_t* frame, size_t length, IoInterface* from_iface);
     void release();
 
+    // Move the contents of this packet to a new heap allocated packet,
+    // leaving this one empty (as if release() had been called).
+    Packet* detach();
+
+    // Warn about this packet, with "reason" and a one line summary of
+    // its addresses, ports, TCP flags and sequence numbers. The values
+    // go through the format string, so a message dropped by the rate
+    // limit costs no formatting.
+    void warn_summary(const char* reason) const;
+
     // Size of packet buffer.
     size_t length_;
 
@@ -41,6 +51,12 @@ public:
     // Ethernet header (coincides with start of packet buffer).
     pkt_eth_t* ethh_;
 
+    // Link for PacketQueue.
+    Packet* next_;
+    // When the packet was queued, or is due to be sent, depending on
+    // which queue it is in.
+    double timestamp_;
+
 private:
     bool parse_ipv4(uint8_t* frame, size_t length);
     bool parse_ipv6(uint8_t* frame, size_t length);
@@ -10,49 +10,39 @@
 #include "log.h"
 #include "packet.h"
 
-PcapDumper::PcapDumper(const std::string& file)
-    : filename_(file),
-      open_(false) {
+PcapDumper::PcapDumper(PcapWriter* writer, const std::string& file)
+    : writer_(writer),
+      filename_(file),
+      file_(0) {
 }
 
 PcapDumper::~PcapDumper() {
-    if (open_) {
+    if (is_open()) {
         close();
     }
 }
 
 bool PcapDumper::open() {
-    assert(!open_);
+    assert(!is_open());
 
-    pcap_ = pcap_open_dead(DLT_EN10MB, PKT_IP_MAX_SIZE);
-    pcap_dumper_ = pcap_dump_open(pcap_, filename_.c_str());
-
-    if (pcap_dumper_ == NULL) {
-        warn("pcap_dump_open failed: %s", pcap_geterr(pcap_));
+    if (writer_ == NULL) {
+        warn("No trace file writer for '%s'", filename_.c_str());
         return false;
     }
-
-    open_ = true;
+    file_ = writer_->open(filename_);
     return true;
 }
 
 void PcapDumper::close() {
-    assert(open_);
-    pcap_dump_flush(pcap_dumper_);
-    pcap_dump_close(pcap_dumper_);
-    pcap_close(pcap_);
+    assert(is_open());
+    writer_->close(file_);
+    file_ = 0;
 }
 
 void PcapDumper::dump_packet(Packet* packet) {
-    if (!open_) {
+    if (!is_open()) {
         return;
     }
 
-    struct pcap_pkthdr h;
-    h.caplen = packet->length_;
-    h.len = packet->length_;
-    gettimeofday(&h.ts, NULL);
-    pcap_dump(reinterpret_cast<uint8_t*>(pcap_dumper_),
-              &h,
-              reinterpret_cast<uint8_t*>(packet->ethh_));
+    writer_->write(file_, packet);
 }
@@ -6,27 +6,33 @@
 #ifndef PCAP_DUMPER_H_
 #define PCAP_DUMPER_H_
 
-#include <pcap.h>
+#include <cstdint>
+#include <string>
 
 #include "packet.h"
+#include "pcap-writer.h"
 
-// Write packets to a trace file in pcap format.
+// Write packets to a trace file in pcap format. The file is written by
+// the PcapWriter's thread.
 class PcapDumper {
 public:
-    PcapDumper(const std::string& file);
+    PcapDumper(PcapWriter* writer, const std::string& file);
     ~PcapDumper();
 
+    // Size of the write buffer of an open trace file.
+    static const size_t kBufferSize = PcapWriter::kBufferSize;
+
     bool open();
     void close();
+    bool is_open() const { return file_ != 0; }
 
     void dump_packet(Packet* packet);
 
 private:
+    PcapWriter* writer_;
     std::string filename_;
-
-    pcap_t* pcap_;
-    pcap_dumper_t* pcap_dumper_;
-    bool open_;
+    // The writer's id for the file, or 0 if not open.
+    uint32_t file_;
 };
 
 #endif // PCAP_DUMPER_H
@@ -0,0 +1,286 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#include "pcap-writer.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "log.h"
+
+static const size_t kRingSize = 16384;
+// Size of the byte ring for the packet data waiting for the writer.
+static const size_t kMaxQueuedBytes = 8 * 1024 * 1024;
+// How often to retry queueing a backlog.
+static const double kRetryInterval = 0.01;
+
+PcapWriter::PcapWriter(State* state)
+    : state_(state),
+      ring_(kRingSize),
+      data_tail_(0),
+      queued_bytes_(0),
+      retry_timer_(state, [this] (Timer* timer) {
+              if (!drain_backlog()) {
+                  timer->reschedule(kRetryInterval);
+              }
+          }),
+      next_file_(0),
+      dropped_(state->stats.counter("pcap.dropped")),
+      sleeping_(false),
+      wake_fd_(eventfd(0, EFD_CLOEXEC)),
+      stopping_(false),
+      written_(0),
+      open_failed_(0) {
+    if (wake_fd_ < 0) {
+        fail_with_errno("eventfd");
+    }
+    state->stats.add_gauge("pcap.written",
+                           [this] () { return written_.load(); });
+    state->stats.add_gauge("pcap.open_failed",
+                           [this] () { return open_failed_.load(); });
+    state->stats.add_gauge("pcap.queued_bytes",
+                           [this] () { return queued_bytes_.load(); });
+}
+
+PcapWriter::~PcapWriter() {
+    // Nothing else is being queued any more, so it's fine to wait for
+    // the writer here.
+    while (!drain_backlog()) {
+        sched_yield();
+    }
+    if (thread_.joinable()) {
+        stopping_ = true;
+        wake();
+        thread_.join();
+    }
+    ::close(wake_fd_);
+
+    while (!files_.empty()) {
+        close_file(files_.begin()->first);
+    }
+}
+
+uint32_t PcapWriter::open(const std::string& filename) {
+    // No thread until there's something to write.
+    if (!thread_.joinable()) {
+        data_.reset(new uint8_t[kMaxQueuedBytes]);
+        thread_ = std::thread([this] () { run(); });
+    }
+    if (++next_file_ == 0) {
+        ++next_file_;
+    }
+
+    Record record;
+    record.type = OPEN;
+    record.file = next_file_;
+    record.length = 0;
+    record.reserved = 0;
+    record.data = reinterpret_cast<uint8_t*>(strdup(filename.c_str()));
+    push_control(record);
+
+    return next_file_;
+}
+
+void PcapWriter::write(uint32_t file, const Packet* p) {
+    // Keep packets behind any OPEN that's still waiting.
+    if (!backlog_.empty() && !drain_backlog()) {
+        ++*dropped_;
+        return;
+    }
+
+    // Frames are contiguous in data_; one that doesn't fit before the
+    // end starts over from the beginning.
+    size_t offset = data_tail_;
+    size_t reserved = p->length_;
+    if (offset + p->length_ > kMaxQueuedBytes) {
+        reserved += kMaxQueuedBytes - offset;
+        offset = 0;
+    }
+    // Acquire pairs with the writer freeing the bytes, so that it's done
+    // reading a frame before it gets overwritten.
+    if (queued_bytes_.load(std::memory_order_acquire) + reserved >
+        kMaxQueuedBytes) {
+        ++*dropped_;
+        return;
+    }
+
+    Record record;
+    record.type = PACKET;
+    record.file = file;
+    record.time = ev_now(state_->loop);
+    record.length = p->length_;
+    record.reserved = reserved;
+    record.data = &data_[offset];
+    memcpy(record.data, p->ethh_, record.length);
+
+    queued_bytes_ += reserved;
+    if (!ring_.push(record)) {
+        queued_bytes_ -= reserved;
+        ++*dropped_;
+        return;
+    }
+    data_tail_ = offset + p->length_;
+    notify();
+}
+
+void PcapWriter::close(uint32_t file) {
+    Record record;
+    record.type = CLOSE;
+    record.file = file;
+    record.length = 0;
+    record.reserved = 0;
+    record.data = NULL;
+    push_control(record);
+}
+
+void PcapWriter::push_control(const Record& record) {
+    if ((!backlog_.empty() && !drain_backlog()) || !ring_.push(record)) {
+        backlog_.push_back(record);
+        retry_timer_.reschedule(kRetryInterval);
+        return;
+    }
+    notify();
+}
+
+bool PcapWriter::drain_backlog() {
+    bool pushed = false;
+    while (!backlog_.empty()) {
+        if (!ring_.push(backlog_.front())) {
+            break;
+        }
+        backlog_.pop_front();
+        pushed = true;
+    }
+    if (pushed) {
+        notify();
+    }
+    return backlog_.empty();
+}
+
+void PcapWriter::notify() {
+    // Pairs with the fence in run(): either the writer sees the new
+    // record, or we see that it's going to sleep.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_relaxed)) {
+        wake();
+    }
+}
+
+void PcapWriter::wake() {
+    sleeping_ = false;
+    uint64_t one = 1;
+    if (::write(wake_fd_, &one, sizeof(one)) < 0) {
+        warn_with_errno("write");
+    }
+}
+
+void PcapWriter::run() {
+    Record record;
+
+    while (true) {
+        bool handled = false;
+        while (ring_.pop(&record)) {
+            handle(record);
+            handled = true;
+        }
+        if (handled) {
+            continue;
+        }
+
+        // Anything queued before stopping_ was set is in the ring by
+        // now, and was handled above.
+        if (stopping_) {
+            if (ring_.empty()) {
+                return;
+            }
+            continue;
+        }
+
+        // Announce that we're going to sleep before checking the ring
+        // one more time, so that a record queued in between is sure to
+        // wake us up.
+        sleeping_ = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!ring_.empty() || stopping_) {
+            sleeping_ = false;
+            continue;
+        }
+
+        uint64_t count;
+        if (read(wake_fd_, &count, sizeof(count)) < 0 && errno != EINTR) {
+            warn_with_errno("read");
+        }
+    }
+}
+
+void PcapWriter::handle(const Record& record) {
+    switch (record.type) {
+    case OPEN:
+        open_file(record.file, reinterpret_cast<char*>(record.data));
+        free(record.data);
+        break;
+    case PACKET: {
+        auto it = files_.find(record.file);
+        if (it != files_.end()) {
+            struct pcap_pkthdr h;
+            h.caplen = record.length;
+            h.len = record.length;
+            h.ts.tv_sec = static_cast<time_t>(record.time);
+            h.ts.tv_usec = (record.time - h.ts.tv_sec) * 1000000;
+            pcap_dump(reinterpret_cast<uint8_t*>(it->second.dumper), &h,
+                      record.data);
+            ++written_;
+        }
+        queued_bytes_.fetch_sub(record.reserved, std::memory_order_release);
+        break;
+    }
+    case CLOSE:
+        close_file(record.file);
+        break;
+    }
+}
+
+void PcapWriter::open_file(uint32_t id, const char* filename) {
+    // Use a buffer of a known size, so that it can be accounted for.
+    FILE* file = fopen(filename, "w");
+    if (file == NULL) {
+        warn_with_errno("couldn't open '%s'", filename);
+        ++open_failed_;
+        return;
+    }
+
+    File& f = files_[id];
+    f.buffer = new char[kBufferSize];
+    setvbuf(file, f.buffer, _IOFBF, kBufferSize);
+
+    f.pcap = pcap_open_dead(DLT_EN10MB, PKT_IP_MAX_SIZE);
+    f.dumper = pcap_dump_fopen(f.pcap, file);
+    if (f.dumper == NULL) {
+        warn("pcap_dump_fopen failed: %s", pcap_geterr(f.pcap));
+        ++open_failed_;
+        fclose(file);
+        pcap_close(f.pcap);
+        delete[] f.buffer;
+        files_.erase(id);
+    }
+}
+
+void PcapWriter::close_file(uint32_t id) {
+    auto it = files_.find(id);
+    if (it == files_.end()) {
+        return;
+    }
+
+    File& f = it->second;
+    pcap_dump_flush(f.dumper);
+    pcap_dump_close(f.dumper);
+    pcap_close(f.pcap);
+    delete[] f.buffer;
+    files_.erase(it);
+}
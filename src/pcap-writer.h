@@ -0,0 +1,116 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#ifndef _PCAP_WRITER_H_
+#define _PCAP_WRITER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <pcap.h>
+#include <string>
+#include <thread>
+
+#include "base.h"
+#include "packet.h"
+#include "spsc-ring.h"
+#include "state.h"
+
+// Writes trace files on a thread of its own, so that the event loop
+// never waits for the disk. The loop thread only copies each packet into
+// a preallocated byte ring; the writer thread owns all the open files.
+// If the writer falls behind, packets are dropped from the traces rather
+// than from the traffic. The thread is only started when the first file is opened,
+// and sleeps while there's nothing to write.
+class PcapWriter {
+public:
+    // Size of the write buffer of an open trace file.
+    static const size_t kBufferSize = 65536;
+
+    explicit PcapWriter(State* state);
+    // Writes out everything queued, and closes all files.
+    ~PcapWriter();
+
+    // The methods below are only called from the event loop thread.
+
+    // Start a new trace file, and return its id (never 0). Failing to
+    // create the file is only reported by the writer thread.
+    uint32_t open(const std::string& filename);
+    // Append a packet to a trace file.
+    void write(uint32_t file, const Packet* p);
+    void close(uint32_t file);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(PcapWriter);
+
+    enum Type {
+        OPEN,
+        PACKET,
+        CLOSE,
+    };
+
+    struct Record {
+        Type type;
+        uint32_t file;
+        ev_tstamp time;
+        uint32_t length;
+        // Bytes of data_ used by the frame, including any skipped at the
+        // end of data_ to keep the frame contiguous.
+        uint32_t reserved;
+        // The frame (in data_), or for OPEN the file name (malloc'd).
+        uint8_t* data;
+    };
+
+    struct File {
+        pcap_t* pcap;
+        pcap_dumper_t* dumper;
+        char* buffer;
+    };
+
+    // Queue an OPEN or CLOSE. These can't be dropped, so ones that don't
+    // fit in the ring wait in the backlog.
+    void push_control(const Record& record);
+    // Move as much of the backlog into the ring as fits. Return true if
+    // the backlog is empty.
+    bool drain_backlog();
+    // Wake up the writer if it's sleeping.
+    void notify();
+    void wake();
+
+    // Writer thread.
+    void run();
+    void handle(const Record& record);
+    void open_file(uint32_t file, const char* filename);
+    void close_file(uint32_t file);
+
+    State* state_;
+    SpscRing<Record> ring_;
+    // Packet data of the records in the ring, allocated with the thread.
+    std::unique_ptr<uint8_t[]> data_;
+    // Where the next frame goes in data_.
+    size_t data_tail_;
+    // Bytes of data_ in use. Freed by the writer once it's done with a
+    // frame, in the same order they were used.
+    std::atomic<size_t> queued_bytes_;
+    std::deque<Record> backlog_;
+    Timer retry_timer_;
+    uint32_t next_file_;
+    uint64_t* dropped_;
+
+    // Only touched by the writer thread.
+    std::map<uint32_t, File> files_;
+    // Set while the writer is about to block on wake_fd_.
+    std::atomic<bool> sleeping_;
+    int wake_fd_;
+    std::atomic<bool> stopping_;
+    std::thread thread_;
+
+    std::atomic<uint64_t> written_;
+    std::atomic<uint64_t> open_failed_;
+};
+
+#endif // _PCAP_WRITER_H_
@@ -0,0 +1,273 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#include "pipeline.h"
+
+#include <cerrno>
+#include <cstring>
+#include <google/gflags.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "realtime.h"
+
+DECLARE_int32(busy_poll_us);
+
+static const size_t kRingSize = 4096;
+// Largest frame that can be sent (the pcap backend's snaplen).
+static const size_t kFrameSize = 2048;
+// Packets to read before waking up the loop.
+static const int kRxBatch = 64;
+// Packets to send before flushing.
+static const int kTxBatch = 64;
+// How often (in ms) an idle reader checks whether it should stop.
+static const int kPollTimeoutMs = 100;
+
+PipelineRx::PipelineRx(State* state, IoBackend* io, int budget,
+                       const Handler& handler)
+    : state_(state),
+      io_(io),
+      handler_(handler),
+      budget_(budget),
+      budget_exhausted_(state->stats.counter(
+                            "budget." + io->iface()->name() + ".exhausted")),
+      cpu_(realtime_reserve_cpu()),
+      pool_(new Packet[kRingSize]),
+      ring_(kRingSize),
+      free_(kRingSize),
+      stopping_(false),
+      packets_(0),
+      ring_full_(0) {
+    for (size_t i = 0; i < kRingSize; ++i) {
+        free_.push(&pool_[i]);
+    }
+
+    async_.payload = this;
+    ev_async_init(&async_.watcher, drain);
+    ev_async_start(state->loop, &async_.watcher);
+
+    const std::string prefix = "pipeline." + io->iface()->name() + ".";
+    state->stats.add_gauge(prefix + "rx_packets",
+                           [this] () { return packets_.load(); });
+    state->stats.add_gauge(prefix + "rx_ring_full",
+                           [this] () { return ring_full_.load(); });
+}
+
+PipelineRx::~PipelineRx() {
+    stop();
+    ev_async_stop(state_->loop, &async_.watcher);
+}
+
+void PipelineRx::start() {
+    thread_ = std::thread([this] () { run(); });
+}
+
+void PipelineRx::stop() {
+    stopping_ = true;
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void PipelineRx::run() {
+    realtime_thread(cpu_, "pipeline rx " + io_->iface()->name());
+
+    struct pollfd pfd;
+    pfd.fd = io_->select_fd();
+    pfd.events = POLLIN;
+
+    // The packet to receive into next, if we have one.
+    Packet* p = NULL;
+    // With busy polling, keep trying for a while after the last packet
+    // before sleeping in poll().
+    const double busy_poll = FLAGS_busy_poll_us * 0.000001;
+    double last_packet = ev_time();
+
+    while (!stopping_) {
+        int received = 0;
+        bool full = false;
+        while (received < kRxBatch) {
+            if (!p && !free_.pop(&p)) {
+                full = true;
+                break;
+            }
+            if (!io_->receive(p)) {
+                break;
+            }
+            // There are only kRingSize packets, so this can't fail.
+            ring_.push(p);
+            p = NULL;
+            ++received;
+        }
+
+        if (received) {
+            packets_ += received;
+            ev_async_send(state_->loop, &async_.watcher);
+            if (busy_poll > 0) {
+                last_packet = ev_time();
+            }
+        }
+
+        if (full) {
+            // Every packet is waiting for the loop. Leave the rest in
+            // the kernel's buffer until it catches up.
+            ++ring_full_;
+            ev_async_send(state_->loop, &async_.watcher);
+            sched_yield();
+        } else if (!received &&
+                   (busy_poll == 0 || ev_time() - last_packet > busy_poll)) {
+            if (::poll(&pfd, 1, kPollTimeoutMs) > 0) {
+                last_packet = ev_time();
+            }
+        }
+    }
+}
+
+bool PipelineRx::poll() {
+    int received = 0;
+    Packet* p;
+    while (received < budget_ && ring_.pop(&p)) {
+        handler_(p);
+        p->release();
+        free_.push(p);
+        ++received;
+    }
+    if (received == budget_ && !ring_.empty()) {
+        ++*budget_exhausted_;
+    }
+    return received > 0;
+}
+
+void PipelineRx::drain(struct ev_loop* loop, ev_async* w, int revents) {
+    PipelineRx* rx = reinterpret_cast<AsyncWatcher*>(w)->payload;
+    rx->poll();
+    if (!rx->ring_.empty()) {
+        // Come back for the rest after the other pending events.
+        ev_async_send(loop, w);
+    }
+}
+
+PipelineTx::PipelineTx(State* state, IoBackend* io)
+    : IoBackend(io->iface()),
+      io_(io),
+      cpu_(realtime_reserve_cpu()),
+      buffers_(new uint8_t[kRingSize * kFrameSize]),
+      ring_(kRingSize),
+      free_(kRingSize),
+      sleeping_(false),
+      wake_fd_(eventfd(0, EFD_CLOEXEC)),
+      stopping_(false),
+      packets_(0),
+      dropped_(0) {
+    if (wake_fd_ < 0) {
+        fail_with_errno("eventfd");
+    }
+    for (size_t i = 0; i < kRingSize; ++i) {
+        free_.push(&buffers_[i * kFrameSize]);
+    }
+    io->iface()->set_io(this);
+
+    const std::string prefix = "pipeline." + io->iface()->name() + ".";
+    state->stats.add_gauge(prefix + "tx_packets",
+                           [this] () { return packets_.load(); });
+    state->stats.add_gauge(prefix + "tx_dropped",
+                           [this] () { return dropped_.load(); });
+}
+
+PipelineTx::~PipelineTx() {
+    stop();
+    iface()->set_io(io_);
+    ::close(wake_fd_);
+}
+
+void PipelineTx::start() {
+    thread_ = std::thread([this] () { run(); });
+}
+
+void PipelineTx::stop() {
+    stopping_ = true;
+    if (thread_.joinable()) {
+        uint64_t one = 1;
+        if (write(wake_fd_, &one, sizeof(one)) < 0) {
+            warn_with_errno("write");
+        }
+        thread_.join();
+    }
+}
+
+bool PipelineTx::inject(Packet* p) {
+    // The caller keeps the packet (and may not even own its frame), so
+    // the frame has to be copied. If no buffer is free, the ring is full.
+    Frame frame;
+    if (p->length_ > kFrameSize || !free_.pop(&frame.data)) {
+        ++dropped_;
+        return false;
+    }
+    frame.length = p->length_;
+    memcpy(frame.data, p->ethh_, frame.length);
+
+    // There are only kRingSize buffers, so this can't fail.
+    ring_.push(frame);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_relaxed)) {
+        wake();
+    }
+    return true;
+}
+
+void PipelineTx::wake() {
+    sleeping_ = false;
+    uint64_t one = 1;
+    if (write(wake_fd_, &one, sizeof(one)) < 0) {
+        warn_with_errno("write");
+    }
+}
+
+void PipelineTx::run() {
+    realtime_thread(cpu_, "pipeline tx " + io_->iface()->name());
+
+    // Sending on the backend while the reader thread receives from it
+    // is fine: the two only share the socket.
+    Packet p;
+
+    while (!stopping_) {
+        int sent = 0;
+        Frame frame;
+        while (sent < kTxBatch && ring_.pop(&frame)) {
+            p.ethh_ = reinterpret_cast<pkt_eth_t*>(frame.data);
+            p.length_ = frame.length;
+            io_->inject(&p);
+            // The buffer belongs to the ring, not to the packet.
+            p.ethh_ = NULL;
+            free_.push(frame.data);
+            ++sent;
+        }
+
+        if (sent) {
+            io_->flush();
+            packets_ += sent;
+            continue;
+        }
+
+        // Nothing to send. Announce that we're going to sleep before
+        // checking the ring one more time, so that a packet queued in
+        // between is sure to wake us up.
+        sleeping_ = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!ring_.empty() || stopping_) {
+            sleeping_ = false;
+            continue;
+        }
+
+        uint64_t count;
+        if (read(wake_fd_, &count, sizeof(count)) < 0 && errno != EINTR) {
+            warn_with_errno("read");
+        }
+    }
+}
@@ -0,0 +1,126 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+// Pipeline mode: receiving and sending packets is moved off the event
+// loop thread onto dedicated threads for each interface, connected to
+// the loop by SPSC rings. All connection state stays owned by the loop
+// thread; only packets cross between threads.
+
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+
+#include "base.h"
+#include "io-backend.h"
+#include "spsc-ring.h"
+#include "state.h"
+
+// Reads packets from an interface on its own thread, and hands them to
+// the event loop. The packets come from a fixed pool, and go back to
+// the reader through a second ring once handled.
+class PipelineRx {
+public:
+    // Called on the loop thread for each received packet. The packet is
+    // released and reused afterwards (unless it's detached).
+    typedef std::function<void(Packet*)> Handler;
+
+    // The loop handles at most "budget" packets from this reader per
+    // iteration.
+    PipelineRx(State* state, IoBackend* io, int budget,
+               const Handler& handler);
+    ~PipelineRx();
+
+    void start();
+    void stop();
+
+    // Handle the packets waiting in the ring (up to the budget) right
+    // away, on the loop thread. Return true if there were any.
+    bool poll();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(PipelineRx);
+
+    typedef libev_watcher<ev_async, PipelineRx*> AsyncWatcher;
+
+    void run();
+    static void drain(struct ev_loop* loop, ev_async* w, int revents);
+
+    State* state_;
+    IoBackend* io_;
+    Handler handler_;
+    int budget_;
+    uint64_t* budget_exhausted_;
+    // In real-time mode, the CPU for the thread (or -1).
+    int cpu_;
+    std::unique_ptr<Packet[]> pool_;
+    // Received packets, from the reader to the loop.
+    SpscRing<Packet*> ring_;
+    // Handled packets, from the loop back to the reader.
+    SpscRing<Packet*> free_;
+    AsyncWatcher async_;
+    std::atomic<bool> stopping_;
+    std::thread thread_;
+
+    std::atomic<uint64_t> packets_;
+    // Times the reader had to wait for the loop to catch up.
+    std::atomic<uint64_t> ring_full_;
+};
+
+// Sends packets to an interface on its own thread. Replaces the real
+// backend as the interface's io(), so everything sent toward the
+// interface from the loop thread goes through the ring.
+class PipelineTx : public IoBackend {
+public:
+    PipelineTx(State* state, IoBackend* io);
+    virtual ~PipelineTx();
+
+    void start();
+    void stop();
+
+    // The real backend is opened / closed by its owner.
+    virtual bool open() { return true; }
+    virtual void close() { }
+
+    // Queue a copy of the packet. If the ring is full, or the packet is
+    // too large for a frame buffer, the packet is dropped.
+    virtual bool inject(Packet* p);
+    virtual bool receive(Packet* p) { return false; }
+    virtual int select_fd() const { return -1; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(PipelineTx);
+
+    struct Frame {
+        uint8_t* data;
+        uint32_t length;
+    };
+
+    void run();
+    void wake();
+
+    IoBackend* io_;
+    int cpu_;
+    // Storage for all the frames; there's a buffer for each ring slot.
+    std::unique_ptr<uint8_t[]> buffers_;
+    // Frames to send, from the loop to the sender.
+    SpscRing<Frame> ring_;
+    // Sent frames' buffers, from the sender back to the loop.
+    SpscRing<uint8_t*> free_;
+    // Set while the sender is about to block on wake_fd_.
+    std::atomic<bool> sleeping_;
+    int wake_fd_;
+    std::atomic<bool> stopping_;
+    std::thread thread_;
+
+    std::atomic<uint64_t> packets_;
+    std::atomic<uint64_t> dropped_;
+};
+
+#endif // _PIPELINE_H_
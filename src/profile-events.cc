@@ -0,0 +1,98 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#include "profile-events.h"
+
+#include <algorithm>
+#include <cmath>
+#include <ev.h>
+#include <limits>
+
+static const double kForever = std::numeric_limits<double>::infinity();
+
+// Number of occurrences of a series starting at "start" and repeating
+// every "interval" (if non-zero) up to and including time "now". Also
+// updates "next" if the next occurrence is earlier than it.
+static int64_t occurrences(double start, double interval, double now,
+                           double* next) {
+    if (now < start) {
+        *next = std::min(*next, start);
+        return 0;
+    }
+    if (interval <= 0) {
+        return 1;
+    }
+
+    int64_t count = std::floor((now - start) / interval);
+    if (start + (count + 1) * interval <= now) {
+        // Rounding error.
+        count++;
+    }
+    *next = std::min(*next, start + (count + 1) * interval);
+    return count + 1;
+}
+
+ProfileEvents::ProfileEvents()
+    : origin_(ev_time()),
+      valid_from_(-kForever),
+      valid_until_(kForever) {
+}
+
+void ProfileEvents::update(
+    const google::protobuf::RepeatedPtrField<TimedEvent>& events) {
+    events_.clear();
+    for (const auto& event : events) {
+        Event compiled;
+        compiled.start = event.trigger_time();
+        if (!event.wall_clock()) {
+            compiled.start += origin_;
+        }
+        compiled.duration = event.has_duration() ? event.duration() : -1;
+        compiled.repeat_interval = event.repeat_interval();
+        compiled.effect.CopyFrom(event.effect());
+        events_.push_back(compiled);
+    }
+
+    // Recompute on the next call.
+    valid_from_ = kForever;
+}
+
+void ProfileEvents::recompute(double now) {
+    ProfileParameters params;
+    double next = kForever;
+
+    for (const auto& event : events_) {
+        int64_t applied = occurrences(event.start, event.repeat_interval,
+                                      now, &next);
+        int64_t active = applied;
+        if (event.duration >= 0) {
+            active -= occurrences(event.start + event.duration,
+                                  event.repeat_interval, now, &next);
+        }
+
+        const Effect& effect = event.effect;
+        params.extra_rtt += active * effect.extra_rtt();
+        params.downlink_kbps_change +=
+            active * effect.downlink().throughput_kbps_change();
+        params.uplink_kbps_change +=
+            active * effect.uplink().throughput_kbps_change();
+        params.downlink_drop_bytes +=
+            applied * effect.downlink().drop_bytes();
+        params.uplink_drop_bytes +=
+            applied * effect.uplink().drop_bytes();
+    }
+
+    if (params.extra_rtt != current_.extra_rtt ||
+        params.downlink_kbps_change != current_.downlink_kbps_change ||
+        params.uplink_kbps_change != current_.uplink_kbps_change ||
+        params.downlink_drop_bytes != current_.downlink_drop_bytes ||
+        params.uplink_drop_bytes != current_.uplink_drop_bytes) {
+        params.epoch = current_.epoch + 1;
+        current_ = params;
+    }
+
+    valid_from_ = now;
+    valid_until_ = next;
+}
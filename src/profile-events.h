@@ -0,0 +1,88 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+// Profile events: timed events that happen to all the connections of a
+// profile at once. Rather than each connection running timers, the
+// profile computes the combined effect of its events at the current
+// time, and bumps an epoch number whenever that changes. Connections
+// compare the epoch on each packet, and apply the difference when it
+// has moved.
+
+#ifndef _PROFILE_EVENTS_H_
+#define _PROFILE_EVENTS_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "base.h"
+#include "FlowDisruptorConfig.pb.h"
+
+// The combined effect of the profile events at some point in time.
+struct ProfileParameters {
+    ProfileParameters()
+        : epoch(0),
+          extra_rtt(0),
+          downlink_kbps_change(0),
+          uplink_kbps_change(0),
+          downlink_drop_bytes(0),
+          uplink_drop_bytes(0) {
+    }
+
+    // Changes whenever any of the other values change.
+    uint64_t epoch;
+    double extra_rtt;
+    int64_t downlink_kbps_change;
+    int64_t uplink_kbps_change;
+    // Drops are never reverted, so these are the totals of every drop
+    // so far.
+    int64_t downlink_drop_bytes;
+    int64_t uplink_drop_bytes;
+};
+
+class ProfileEvents {
+public:
+    ProfileEvents();
+
+    // Replace the events (on configuration reload).
+    void update(
+        const google::protobuf::RepeatedPtrField<TimedEvent>& events);
+
+    // The parameters in effect at time "now". This is just a couple of
+    // comparisons unless an event has started or ended since the last
+    // call.
+    const ProfileParameters& at(double now) {
+        if (now < valid_from_ || now >= valid_until_) {
+            recompute(now);
+        }
+        return current_;
+    }
+
+private:
+    struct Event {
+        // Absolute time of the first occurrence.
+        double start;
+        // Negative if the event is never reverted.
+        double duration;
+        // Zero if the event doesn't repeat.
+        double repeat_interval;
+        Effect effect;
+    };
+
+    void recompute(double now);
+
+    std::vector<Event> events_;
+    // Time that relative trigger times are measured from: when the
+    // profile was first loaded.
+    double origin_;
+
+    ProfileParameters current_;
+    // current_ is valid for times in [valid_from_, valid_until_).
+    double valid_from_;
+    double valid_until_;
+
+    DISALLOW_COPY_AND_ASSIGN(ProfileEvents);
+};
+
+#endif // _PROFILE_EVENTS_H_
@@ -0,0 +1,147 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#include "realtime.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <google/gflags.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include "log.h"
+#include "strutil.h"
+
+DECLARE_bool(realtime);
+DECLARE_int32(rt_priority);
+DECLARE_string(rt_cpus);
+DECLARE_int32(rt_prefault_heap_mb);
+
+// Stack each real-time thread faults in at startup.
+static const size_t kStackPrefault = 256 * 1024;
+
+static std::vector<int> cpus;
+static std::atomic<int> next_cpu(0);
+
+// Parse a list like "2,4-7".
+static std::vector<int> parse_cpus(const std::string& list) {
+    std::vector<int> result;
+
+    for (const std::string& part : split_string_to_vector(list, ",")) {
+        char* end;
+        long first = strtol(part.c_str(), &end, 10);
+        long last = first;
+        if (*end == '-') {
+            last = strtol(end + 1, &end, 10);
+        }
+        if (part.empty() || *end || first < 0 || last < first ||
+            last >= CPU_SETSIZE) {
+            fail("Invalid CPU list '%s'", list.c_str());
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            result.push_back(cpu);
+        }
+    }
+
+    return result;
+}
+
+void realtime_prefault(void* memory, size_t size) {
+    if (!FLAGS_realtime) {
+        return;
+    }
+
+    // Write to each page, so that copy-on-write and zero pages get
+    // their real pages too.
+    volatile uint8_t* bytes = static_cast<volatile uint8_t*>(memory);
+    size_t page = sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < size; i += page) {
+        bytes[i] = bytes[i];
+    }
+}
+
+void realtime_init() {
+    if (!FLAGS_realtime) {
+        return;
+    }
+
+    if (!FLAGS_rt_cpus.empty()) {
+        cpus = parse_cpus(FLAGS_rt_cpus);
+    }
+
+    // Freed memory stays in the heap, and large blocks come from the
+    // heap rather than fresh mappings, so that the prefaulted heap is
+    // reused.
+    if (!mallopt(M_TRIM_THRESHOLD, -1) || !mallopt(M_MMAP_MAX, 0)) {
+        log_warn(NULL, "Real-time: couldn't configure malloc");
+    }
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        log_warn_with_errno(NULL, "Real-time: couldn't lock memory");
+    } else {
+        log_info(NULL, "Real-time: memory locked");
+    }
+
+    if (FLAGS_rt_prefault_heap_mb > 0) {
+        size_t size = FLAGS_rt_prefault_heap_mb * 1024ul * 1024;
+        void* heap = malloc(size);
+        if (heap == NULL) {
+            log_warn(NULL, "Real-time: couldn't prefault %zu bytes of heap",
+                     size);
+        } else {
+            realtime_prefault(heap, size);
+            free(heap);
+            log_info(NULL, "Real-time: prefaulted %zu bytes of heap", size);
+        }
+    }
+}
+
+int realtime_reserve_cpu() {
+    if (cpus.empty()) {
+        return -1;
+    }
+    return cpus[next_cpu++ % cpus.size()];
+}
+
+void realtime_thread(int cpu, const std::string& name) {
+    if (!FLAGS_realtime) {
+        return;
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err) {
+            errno = err;
+            log_warn_with_errno(NULL, "Real-time: couldn't pin %s to CPU %d",
+                                name.c_str(), cpu);
+        } else {
+            log_info(NULL, "Real-time: %s on CPU %d", name.c_str(), cpu);
+        }
+    }
+
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = FLAGS_rt_priority;
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err) {
+        errno = err;
+        log_warn_with_errno(NULL, "Real-time: couldn't run %s at SCHED_FIFO "
+                            "priority %d", name.c_str(), FLAGS_rt_priority);
+    } else {
+        log_info(NULL, "Real-time: %s at SCHED_FIFO priority %d",
+                 name.c_str(), FLAGS_rt_priority);
+    }
+
+    uint8_t stack[kStackPrefault];
+    realtime_prefault(stack, sizeof(stack));
+}
@@ -0,0 +1,35 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+// Real-time mode (--realtime): the data path threads each get a CPU of
+// their own and SCHED_FIFO priority, and all memory is locked and
+// faulted in up front, so that neither the scheduler nor page faults
+// add latency spikes. Everything here is a no-op unless enabled. Each
+// setting is reported in the log, whether it worked or not.
+
+#ifndef _REALTIME_H_
+#define _REALTIME_H_
+
+#include <cstddef>
+#include <string>
+
+// Set up the process: keep malloc from returning memory to the kernel,
+// fault in a heap for it to use, and lock all memory (present and
+// future). Call before allocating the pools and rings.
+void realtime_init();
+
+// Reserve a CPU from --rt_cpus for a data path thread, or return -1 if
+// none were given. Reserved in order and handed out round robin, so the
+// threads should be set up in a deterministic order.
+int realtime_reserve_cpu();
+
+// Make the calling thread a real-time thread, pinned to "cpu" (unless
+// -1). "name" is for the log.
+void realtime_thread(int cpu, const std::string& name);
+
+// Fault in this memory now, rather than on first use.
+void realtime_prefault(void* memory, size_t size);
+
+#endif // _REALTIME_H_
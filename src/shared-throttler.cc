@@ -0,0 +1,256 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#include "shared-throttler.h"
+
+#include <algorithm>
+
+SharedThrottler::Flow::Flow(SharedThrottler* parent, MemoryAccount* memory,
+                            const Output& output)
+    : memory_(memory),
+      output_(output) {
+    member_.parent = parent;
+    member_.flow = this;
+}
+
+SharedThrottler::Flow::~Flow() {
+    if (member_.linked()) {
+        member_.parent->unlink(&member_);
+    }
+    for (SharedThrottler* node = member_.parent; node; node = node->parent_) {
+        node->queued_bytes_ -= queue_.bytes();
+    }
+    member_.parent->state_->memory->release_queue(
+        memory_, MemoryBudget::SHARED_QUEUE, queue_);
+}
+
+void SharedThrottler::Flow::insert(Packet* p, ev_tstamp ready_at) {
+    for (SharedThrottler* node = member_.parent; node; node = node->parent_) {
+        if (node->max_queue_ && node->queued_bytes_ > node->max_queue_) {
+            // Queue full, drop the packet.
+            ++*node->dropped_packets_;
+            delete p;
+            return;
+        }
+    }
+
+    if (!member_.parent->state_->memory->charge_packet(
+            memory_, MemoryBudget::SHARED_QUEUE, p,
+            [this] () { return drop_oldest(); })) {
+        delete p;
+        return;
+    }
+
+    for (SharedThrottler* node = member_.parent; node; node = node->parent_) {
+        node->queued_bytes_ += p->length_;
+    }
+
+    p->timestamp_ = ready_at;
+    queue_.push_back(p);
+    if (queue_.size() == 1) {
+        member_.parent->link(&member_);
+    }
+
+    member_.parent->root()->transmit();
+}
+
+bool SharedThrottler::Flow::drop_oldest() {
+    if (queue_.empty()) {
+        return false;
+    }
+
+    Packet* p = queue_.pop_front();
+    for (SharedThrottler* node = member_.parent; node; node = node->parent_) {
+        node->queued_bytes_ -= p->length_;
+    }
+    if (queue_.empty()) {
+        member_.deficit = 0;
+        member_.parent->unlink(&member_);
+    }
+
+    member_.parent->state_->memory->release_packet(
+        memory_, MemoryBudget::SHARED_QUEUE, p);
+    delete p;
+    return true;
+}
+
+SharedThrottler::SharedThrottler(State* state, SharedThrottler* parent)
+    : state_(state),
+      parent_(parent),
+      bytes_per_second_(0),
+      max_queue_(0),
+      quantum_(1514),
+      link_free_at_(0),
+      queued_bytes_(0),
+      sleeping_(false),
+      transmitting_(false),
+      wake_timer_(state->departures, [this] (WheelTimer*) { wake(); }),
+      dropped_packets_(state->stats.counter("shared_throttler.dropped")) {
+    member_.parent = parent;
+    member_.node = this;
+    active_.prev = active_.next = &active_;
+}
+
+SharedThrottler::~SharedThrottler() {
+    if (member_.linked()) {
+        parent_->unlink(&member_);
+    }
+}
+
+void SharedThrottler::update(const SharedLinkProperties& properties) {
+    bytes_per_second_ = properties.throughput_kbps() * 1000 / 8.0;
+    max_queue_ = properties.max_queue_bytes();
+    quantum_ = std::max(properties.quantum_bytes(), 1u);
+
+    if (!bytes_per_second_ && sleeping_) {
+        wake();
+    }
+}
+
+bool SharedThrottler::is_limited() const {
+    for (const SharedThrottler* node = this; node; node = node->parent_) {
+        if (node->bytes_per_second_ || node->max_queue_) {
+            return true;
+        }
+    }
+    return false;
+}
+
+SharedThrottler* SharedThrottler::root() {
+    SharedThrottler* node = this;
+    while (node->parent_) {
+        node = node->parent_;
+    }
+    return node;
+}
+
+void SharedThrottler::link(Member* member) {
+    bool was_empty = active_.next == &active_;
+
+    member->prev = active_.prev;
+    member->next = &active_;
+    active_.prev->next = member;
+    active_.prev = member;
+
+    if (was_empty) {
+        update_membership();
+    }
+}
+
+void SharedThrottler::unlink(Member* member) {
+    member->prev->next = member->next;
+    member->next->prev = member->prev;
+    member->prev = member->next = NULL;
+
+    if (active_.next == &active_) {
+        update_membership();
+    }
+}
+
+void SharedThrottler::update_membership() {
+    if (!parent_) {
+        return;
+    }
+
+    bool runnable = active_.next != &active_ && !sleeping_;
+    if (runnable && !member_.linked()) {
+        parent_->link(&member_);
+    } else if (!runnable && member_.linked()) {
+        parent_->unlink(&member_);
+    }
+}
+
+SharedThrottler::Flow* SharedThrottler::pick() {
+    for (;;) {
+        Member* member = active_.next;
+        if (member->deficit > 0) {
+            if (member->flow) {
+                return member->flow;
+            }
+            return member->node->pick();
+        }
+
+        // Out of turn: top up the deficit and move to the back of the
+        // round robin.
+        member->deficit += quantum_;
+        if (member->next != &active_) {
+            member->prev->next = member->next;
+            member->next->prev = member->prev;
+            member->prev = active_.prev;
+            member->next = &active_;
+            active_.prev->next = member;
+            active_.prev = member;
+        }
+    }
+}
+
+void SharedThrottler::transmit() {
+    if (transmitting_) {
+        return;
+    }
+    transmitting_ = true;
+
+    ev_tstamp now = ev_now(state_->loop);
+
+    while (!sleeping_ && active_.next != &active_) {
+        Flow* flow = pick();
+        Packet* p = flow->queue_.pop_front();
+        state_->memory->release_packet(flow->memory_,
+                                       MemoryBudget::SHARED_QUEUE, p);
+
+        // Every throttler on the path has capacity (or it wouldn't be in
+        // the round robin), so the packet could have been sent as soon
+        // as the last of them became free.
+        ev_tstamp released_at = p->timestamp_;
+        for (SharedThrottler* node = flow->member_.parent;
+             node;
+             node = node->parent_) {
+            released_at = std::max(released_at, node->link_free_at_);
+        }
+
+        Member* member = &flow->member_;
+        while (member) {
+            SharedThrottler* node = member->parent;
+            member->deficit -= p->length_;
+            node->queued_bytes_ -= p->length_;
+            if (node->bytes_per_second_) {
+                // Time spent waiting for the throttlers above this one
+                // isn't lost: the link may catch up by up to a quantum.
+                ev_tstamp catch_up = node->quantum_ / node->bytes_per_second_;
+                ev_tstamp start = std::max(node->link_free_at_,
+                                           std::max(p->timestamp_,
+                                                    now - catch_up));
+                node->link_free_at_ =
+                    start + p->length_ / node->bytes_per_second_;
+                if (node->link_free_at_ > now) {
+                    node->sleep(now);
+                }
+            }
+            member = node->parent_ ? &node->member_ : NULL;
+        }
+
+        if (flow->queue_.empty()) {
+            flow->member_.deficit = 0;
+            flow->member_.parent->unlink(&flow->member_);
+        }
+
+        flow->output_(p, released_at);
+    }
+
+    transmitting_ = false;
+}
+
+void SharedThrottler::sleep(ev_tstamp now) {
+    sleeping_ = true;
+    wake_timer_.reschedule(link_free_at_ - now);
+    update_membership();
+}
+
+void SharedThrottler::wake() {
+    wake_timer_.stop();
+    sleeping_ = false;
+    update_membership();
+    root()->transmit();
+}
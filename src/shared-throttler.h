@@ -0,0 +1,150 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+// Bandwidth limits shared by many flows, for emulating a common
+// bottleneck. Shared throttlers form a tree: each interface has one, with
+// a child for each profile, whose children in turn are the flows of that
+// profile. Packets that have been released by the flow's own Throttler
+// wait in a per-flow queue, and are released when every throttler on the
+// path to the root has capacity for them. Children get their turns by
+// deficit round robin, so each choice is O(1).
+
+#ifndef _SHARED_THROTTLER_H_
+#define _SHARED_THROTTLER_H_
+
+#include <cstdint>
+#include <functional>
+
+#include "base.h"
+#include "FlowDisruptorConfig.pb.h"
+#include "memory-budget.h"
+#include "packet-queue.h"
+#include "state.h"
+#include "timer-wheel.h"
+
+class SharedThrottler {
+public:
+    // Called for each released packet, with the time it was released.
+    // The output takes ownership of the packet.
+    typedef std::function<void(Packet*, ev_tstamp)> Output;
+
+    class Flow;
+
+    // A child's entry in its parent's round robin.
+    struct Member {
+        Member()
+            : parent(NULL),
+              deficit(0),
+              flow(NULL),
+              node(NULL),
+              prev(NULL),
+              next(NULL) {
+        }
+
+        bool linked() const { return prev != NULL; }
+
+        SharedThrottler* parent;
+        int64_t deficit;
+        // Exactly one of these is set.
+        Flow* flow;
+        SharedThrottler* node;
+        // Links in the parent's list of children that have something to
+        // send.
+        Member* prev;
+        Member* next;
+    };
+
+    // The queue of one flow in a shared throttler.
+    class Flow {
+    public:
+        // Queued packets are charged to "memory".
+        Flow(SharedThrottler* parent, MemoryAccount* memory,
+             const Output& output);
+        // Drops any queued packets.
+        ~Flow();
+
+        // Queue this packet (which became ready to send at "ready_at")
+        // until all the throttlers above this flow have capacity for it.
+        // Takes ownership; it might get dropped.
+        void insert(Packet* p, ev_tstamp ready_at);
+
+        bool has_queued_data() const { return !queue_.empty(); }
+
+    private:
+        DISALLOW_COPY_AND_ASSIGN(Flow);
+        friend class SharedThrottler;
+
+        // Drop the packet at the head of the queue, if there is one, to
+        // make room in the memory budget.
+        bool drop_oldest();
+
+        Member member_;
+        PacketQueue queue_;
+        MemoryAccount* memory_;
+        Output output_;
+    };
+
+    // Make a throttler, as a child of "parent" (or a root, if NULL).
+    SharedThrottler(State* state, SharedThrottler* parent);
+    ~SharedThrottler();
+
+    // Apply these limits (on startup and configuration reload).
+    void update(const SharedLinkProperties& properties);
+
+    // True if this throttler or one of its ancestors limits anything.
+    // If not, flows don't need to go through it at all.
+    bool is_limited() const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(SharedThrottler);
+
+    SharedThrottler* root();
+
+    // Add a child to the round robin / remove it.
+    void link(Member* member);
+    void unlink(Member* member);
+    // Make sure this throttler is in its parent's round robin if and only
+    // if it has children with something to send, and isn't waiting for
+    // capacity.
+    void update_membership();
+
+    // Pick the flow to send the next packet from. Only valid if the
+    // round robin isn't empty.
+    Flow* pick();
+    // Release packets for as long as there's capacity (only called on the
+    // root).
+    void transmit();
+    // Wait until the link has capacity again.
+    void sleep(ev_tstamp now);
+    void wake();
+
+    State* state_;
+    SharedThrottler* parent_;
+    // Our entry in the parent's round robin.
+    Member member_;
+
+    // Children with something to send. Circular, with this as the head.
+    Member active_;
+
+    // Limits. A rate of zero means unlimited.
+    double bytes_per_second_;
+    uint64_t max_queue_;
+    uint32_t quantum_;
+
+    // The time at which the link will be done sending everything
+    // released so far.
+    ev_tstamp link_free_at_;
+    // Data queued below this throttler.
+    uint64_t queued_bytes_;
+    // True while waiting for link capacity.
+    bool sleeping_;
+    // True while releasing packets (only on the root).
+    bool transmitting_;
+    WheelTimer wake_timer_;
+
+    uint64_t* dropped_packets_;
+};
+
+#endif // _SHARED_THROTTLER_H_
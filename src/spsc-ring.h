@@ -0,0 +1,92 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#ifndef _SPSC_RING_H_
+#define _SPSC_RING_H_
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+
+#include "base.h"
+
+// A bounded lock-free queue for passing values from one producer thread
+// to one consumer thread. Each side keeps a cached copy of the other
+// side's index, so the shared cache lines are only touched when the
+// ring looks full (or empty).
+template<class T>
+class SpscRing {
+public:
+    // "capacity" must be a power of two. The slots are initialized
+    // right away, so that they're not page faulted in on the data path.
+    explicit SpscRing(size_t capacity)
+        : slots_(new T[capacity]()),
+          mask_(capacity - 1),
+          head_(0),
+          cached_tail_(0),
+          tail_(0),
+          cached_head_(0) {
+        assert((capacity & mask_) == 0);
+    }
+
+    // Producer side. Return false if the ring is full.
+    bool push(const T& value) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - cached_head_ > mask_) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail - cached_head_ > mask_) {
+                return false;
+            }
+        }
+        slots_[tail & mask_] = value;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. Return false if the ring is empty.
+    bool pop(T* value) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == cached_tail_) {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            if (head == cached_tail_) {
+                return false;
+            }
+        }
+        *value = slots_[head & mask_];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side.
+    bool empty() {
+        return head_.load(std::memory_order_relaxed) ==
+            tail_.load(std::memory_order_acquire);
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(SpscRing);
+
+    // Size of a cache line. The two sides' fields are kept a whole line
+    // apart from each other and from their neighbours with padding, not
+    // alignas(): a C++11 new can't allocate over-aligned objects, and the
+    // rings live inside heap allocated objects.
+    static const size_t kCacheLine = 64;
+
+    std::unique_ptr<T[]> slots_;
+    const size_t mask_;
+
+    char pad0_[kCacheLine];
+    // Written by the consumer.
+    std::atomic<size_t> head_;
+    size_t cached_tail_;
+    char pad1_[kCacheLine];
+    // Written by the producer.
+    std::atomic<size_t> tail_;
+    size_t cached_head_;
+    char pad2_[kCacheLine];
+};
+
+#endif // _SPSC_RING_H_
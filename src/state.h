@@ -11,16 +11,60 @@
 
 #include "config.h"
 #include "connection-table.h"
+#include "stats.h"
+
+class AdmissionControl;
+class DelayLineStore;
+class DelayQueuePool;
+class DurationHistogram;
+class HalfOpenTable;
+class MemoryBudget;
+class PcapWriter;
+class SharedThrottler;
+class TimerWheel;
 
 // All application state.
 struct State {
-    State() :
+    explicit State(struct ev_loop* loop = EV_DEFAULT) :
+        config(&stats),
         connections(ConnectionTable::make()),
-        loop(EV_DEFAULT) {
+        half_open(NULL),
+        admission(NULL),
+        timer_wheel(NULL),
+        departures(NULL),
+        shared_downlink(NULL),
+        shared_uplink(NULL),
+        departure_lateness(NULL),
+        memory(NULL),
+        delay_line(NULL),
+        delay_queue_pool(NULL),
+        pcap_writer(NULL),
+        loop(loop) {
     }
 
+    Stats stats;
     Config config;
     ConnectionTable* connections;
+    HalfOpenTable* half_open;
+    AdmissionControl* admission;
+    // Coarse (millisecond resolution) timers.
+    TimerWheel* timer_wheel;
+    // Packet departure (microsecond resolution) timers.
+    TimerWheel* departures;
+    // Limits on all traffic sent toward each interface; the roots of the
+    // shared throttler trees.
+    SharedThrottler* shared_downlink;
+    SharedThrottler* shared_uplink;
+    // How late packets leave compared to their scheduled departure.
+    DurationHistogram* departure_lateness;
+    // Budget for packet buffers.
+    MemoryBudget* memory;
+    // Where long delay queues spill their packets, if enabled.
+    DelayLineStore* delay_line;
+    // Storage for delay queues too long to fit in the connection.
+    DelayQueuePool* delay_queue_pool;
+    // Writes the trace files of all connections.
+    PcapWriter* pcap_writer;
     struct ev_loop *loop;
 };
 
@@ -0,0 +1,100 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#include "stats.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+
+#include "log.h"
+
+uint64_t* Stats::counter(const std::string& name) {
+    return &counters_[name];
+}
+
+void Stats::add_gauge(const std::string& name, const Stats::Gauge& gauge) {
+    gauges_[name] = gauge;
+}
+
+std::map<std::string, uint64_t> Stats::snapshot() {
+    std::map<std::string, uint64_t> values(counters_);
+
+    for (auto& gauge : gauges_) {
+        values[gauge.first] = gauge.second();
+    }
+
+    return values;
+}
+
+bool Stats::write(const std::string& filename) {
+    std::string tmp_filename = filename + ".tmp";
+
+    FILE* file = fopen(tmp_filename.c_str(), "w");
+    if (file == NULL) {
+        warn_with_errno("couldn't open '%s'", tmp_filename.c_str());
+        return false;
+    }
+
+    for (auto& value : snapshot()) {
+        fprintf(file, "%s %" PRIu64 "\n",
+                value.first.c_str(),
+                value.second);
+    }
+
+    if (fclose(file) != 0) {
+        warn_with_errno("couldn't write '%s'", tmp_filename.c_str());
+        return false;
+    }
+
+    if (rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        warn_with_errno("couldn't rename '%s'", tmp_filename.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void Stats::log() {
+    for (auto& value : snapshot()) {
+        // One line per value, so not rate limited.
+        log_info(NULL, "%s %" PRIu64, value.first.c_str(), value.second);
+    }
+}
+
+DurationHistogram::DurationHistogram(Stats* stats, const std::string& name)
+    : early_(stats->counter(name + ".early")),
+      count_(stats->counter(name + ".count")),
+      total_ns_(stats->counter(name + ".total_ns")),
+      max_ns_(stats->counter(name + ".max_ns")) {
+    static const char* const kLimits[kBuckets - 1] = {
+        "1us", "10us", "100us", "1ms", "10ms",
+    };
+    for (int i = 0; i < kBuckets - 1; ++i) {
+        buckets_[i] = stats->counter(name + ".under_" + kLimits[i]);
+    }
+    buckets_[kBuckets - 1] =
+        stats->counter(name + ".over_" + kLimits[kBuckets - 2]);
+}
+
+void DurationHistogram::record(double seconds) {
+    ++*count_;
+    if (seconds < 0) {
+        ++*early_;
+        return;
+    }
+
+    uint64_t ns = seconds * 1e9;
+    *total_ns_ += ns;
+    *max_ns_ = std::max(*max_ns_, ns);
+
+    int bucket = 0;
+    for (uint64_t limit = 1000;
+         bucket < kBuckets - 1 && ns >= limit;
+         limit *= 10) {
+        ++bucket;
+    }
+    ++*buckets_[bucket];
+}
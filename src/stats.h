@@ -0,0 +1,74 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+
+#include "base.h"
+
+// Named counters and gauges, exported as a whole to a file or the log.
+class Stats {
+public:
+    typedef std::function<uint64_t()> Gauge;
+
+    Stats() {
+    }
+
+    // Return the counter with this name, creating it (initialized to
+    // zero) if it doesn't exist yet. The returned pointer stays valid
+    // for the lifetime of this object, so hot paths should look up
+    // their counters once and keep the pointer around.
+    uint64_t* counter(const std::string& name);
+
+    // Register a value that's computed only when the stats are exported.
+    void add_gauge(const std::string& name, const Gauge& gauge);
+
+    // Write all counters and gauges to this file, one "name value" pair
+    // per line. The file is replaced atomically.
+    bool write(const std::string& filename);
+    // Write all counters and gauges to the log.
+    void log();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(Stats);
+
+    // Current values of all counters and gauges, sorted by name.
+    std::map<std::string, uint64_t> snapshot();
+
+    std::map<std::string, uint64_t> counters_;
+    std::map<std::string, Gauge> gauges_;
+};
+
+// A histogram of durations (e.g. how late something happened), kept as
+// a set of counters: "<name>.early", "<name>.under_<limit>" for each
+// bucket and "<name>.over_<largest limit>", plus "<name>.count",
+// "<name>.total_ns" and "<name>.max_ns".
+class DurationHistogram {
+public:
+    DurationHistogram(Stats* stats, const std::string& name);
+
+    // Record a duration, in seconds. Negative durations count as early.
+    void record(double seconds);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(DurationHistogram);
+
+    static const int kBuckets = 6;
+
+    uint64_t* early_;
+    // Bucket i counts durations under 10^i microseconds; the last one
+    // counts everything longer.
+    uint64_t* buckets_[kBuckets];
+    uint64_t* count_;
+    uint64_t* total_ns_;
+    uint64_t* max_ns_;
+};
+
+#endif // _STATS_H_
@@ -5,18 +5,43 @@
 
 #include "throttler.h"
 
+#include <algorithm>
+
 #include "log.h"
 
-Throttler::Throttler(State* state)
+// The link may have been idle for up to this long before a packet
+// arrives and still get credit for it, letting a burst of 0.1 seconds'
+// worth of data through at once.
+static const ev_tstamp kBurstAllowance = 0.1;
+
+Throttler::Throttler(State* state, MemoryAccount* memory,
+                     const Throttler::Output& output)
     : enabled_(false),
       total_bytes_(0),
-      tick_timer_(state, [this] (Timer*) { tick(); }),
-      queued_cost_(0),
+      throttle_kbps_(0),
+      bytes_per_second_(0),
+      link_free_at_(0),
+      state_(state),
+      memory_(memory),
+      output_(output),
+      release_timer_(state->departures, [this] (WheelTimer*) { transmit(); }),
+      volume_events_([this] (const LinkPropertiesChange& change) {
+              apply(change);
+          },
+          [this] (const LinkPropertiesChange& change) {
+              revert(change);
+          }),
       max_queue_(0),
       drop_bytes_(0) {
 }
 
-void Throttler::enable(const LinkProperties& properties) {
+Throttler::~Throttler() {
+    state_->memory->release_queue(memory_, MemoryBudget::THROTTLER_QUEUE,
+                                  queue_);
+}
+
+void Throttler::enable(const LinkProperties& properties,
+                       std::shared_ptr<const VolumeEventSchedule> events) {
     if (properties.has_throughput_kbps()) {
         enabled_ = true;
         throttle_kbps_ = properties.throughput_kbps();
@@ -25,61 +50,30 @@ void Throttler::enable(const LinkProperties& properties) {
         }
     }
 
-    for (auto event : properties.volume_event()) {
-        if (event.has_trigger_at_bytes()) {
-            pending_events_.insert(std::make_pair(event.trigger_at_bytes(),
-                                                 event));
-        }
+    if (events && !events->empty()) {
+        volume_events_.reset(events);
     }
 
     recompute();
-    tick_timer_.reschedule(0.001);
 }
 
-void Throttler::insert(uint64_t cost, const Throttler::Callback& callback) {
-    for (auto it = pending_events_.begin();
-         it != pending_events_.end();
-         it = pending_events_.begin()) {
-        auto bytes = it->first;
-        if (bytes > total_bytes_) {
-            break;
-        }
+bool Throttler::pass_through(const Packet* p) {
+    // This might activate an event; if it does, insert() won't apply it
+    // a second time.
+    volume_events_.advance(total_bytes_);
 
-        auto event = it->second;
-        pending_events_.erase(it);
-        apply(event.effect());
-
-        if (event.has_active_for_bytes()) {
-            uint64_t stop_at_bytes = event.active_for_bytes() +
-                bytes;
-            active_events_.insert(std::make_pair(stop_at_bytes,
-                                                 event));
-        } else if (event.has_repeat_after_bytes()) {
-            uint64_t retrigger_bytes = event.repeat_after_bytes() +
-                bytes;
-            pending_events_.insert(std::make_pair(retrigger_bytes,
-                                                  event));
-        }
+    if (enabled_ || drop_bytes_) {
+        return false;
     }
 
-    for (auto it = active_events_.begin();
-         it != active_events_.end();
-         it = active_events_.begin()) {
-        auto bytes = it->first;
-        if (bytes > total_bytes_) {
-            break;
-        }
+    total_bytes_ += p->length_;
+    return true;
+}
 
-        auto event = it->second;
-        active_events_.erase(it);
-        revert(event.effect());
-        if (event.has_repeat_after_bytes()) {
-            uint64_t retrigger_bytes = event.repeat_after_bytes() +
-                bytes;
-            pending_events_.insert(std::make_pair(retrigger_bytes,
-                                                  event));
-        }
-    }
+void Throttler::insert(Packet* p) {
+    uint64_t cost = p->length_;
+
+    volume_events_.advance(total_bytes_);
 
     total_bytes_ += cost;
 
@@ -88,48 +82,72 @@ void Throttler::insert(uint64_t cost, const Throttler::Callback& callback) {
         if (drop_bytes_ < 0) {
             drop_bytes_ = 0;
         }
+        delete p;
         return;
     }
 
     if (!enabled_) {
-        callback();
-    } else if (max_queue_ && queued_cost_ > max_queue_) {
+        output_(p, ev_now(state_->loop));
+    } else if (max_queue_ && queue_.bytes() > max_queue_) {
         // Queue full, drop the packet.
+        delete p;
+    } else if (!state_->memory->charge_packet(
+                   memory_, MemoryBudget::THROTTLER_QUEUE, p,
+                   [this] () { return drop_oldest(); })) {
+        delete p;
     } else {
-        queue_.push_back(std::make_pair(cost, callback));
-        queued_cost_ += cost;
-        transmit();
+        p->timestamp_ = ev_now(state_->loop);
+        queue_.push_back(p);
+        if (queue_.size() == 1) {
+            transmit();
+        }
+    }
+}
+
+bool Throttler::drop_oldest() {
+    if (queue_.empty()) {
+        return false;
     }
+
+    Packet* p = queue_.pop_front();
+    state_->memory->release_packet(memory_, MemoryBudget::THROTTLER_QUEUE, p);
+    delete p;
+    return true;
 }
 
 void Throttler::transmit() {
-    while (!queue_.empty()) {
-        uint64_t cost = queue_.front().first;
-        if (capacity_ < cost) {
-            break;
+    ev_tstamp now = ev_now(state_->loop);
+
+    while (!queue_.empty() && bytes_per_second_ > 0) {
+        Packet* p = queue_.front();
+        ev_tstamp start = std::max(link_free_at_,
+                                   p->timestamp_ - kBurstAllowance);
+        ev_tstamp release_at = std::max(start, p->timestamp_);
+        if (release_at > now) {
+            release_timer_.reschedule(release_at - now);
+            return;
         }
-        capacity_ -= cost;
-        queued_cost_ -= cost;
-        queue_.front().second();
+
+        link_free_at_ = start + p->length_ / bytes_per_second_;
+
         queue_.pop_front();
+        state_->memory->release_packet(memory_, MemoryBudget::THROTTLER_QUEUE,
+                                       p);
+        output_(p, release_at);
     }
-}
 
-void Throttler::tick() {
-    capacity_ = std::min(max_capacity_,
-                         capacity_ + capacity_per_tick_);
-    transmit();
-    tick_timer_.reschedule(0.001);
+    release_timer_.stop();
 }
 
 void Throttler::recompute() {
-    uint64_t actual_throttle = std::max(throttle_kbps_, INT64_C(0));
+    if (bytes_per_second_ <= 0) {
+        // The link was stalled, it can't have made any progress.
+        link_free_at_ = std::max(link_free_at_, ev_now(state_->loop));
+    }
 
-    // 0.1 seconds of capacity.
-    max_capacity_ = actual_throttle * 1000 / 8.0 * 0.1;
-    capacity_ = std::min(max_capacity_, capacity_);
-    // Ticks every 0.001 seconds.
-    capacity_per_tick_ = max_capacity_ * 0.01;
+    bytes_per_second_ = std::max(throttle_kbps_, INT64_C(0)) * 1000 / 8.0;
+    // The release time of the head of the queue might have changed.
+    transmit();
 }
 
 void Throttler::apply(const LinkPropertiesChange& properties) {
@@ -6,44 +6,67 @@
 #ifndef _THROTTLER_H_
 #define _THROTTLER_H_
 
-#include <deque>
-#include <map>
 #include <functional>
+#include <memory>
 
+#include "memory-budget.h"
+#include "packet-queue.h"
 #include "state.h"
-
-// A token bucket based throttler.
+#include "timer-wheel.h"
+#include "volume-events.h"
+
+// A bandwidth throttler. Each queued packet is released at the exact
+// time a link of the configured throughput would have finished sending
+// the data before it (i.e. a virtual clock based shaper), after an
+// initial burst of up to 0.1 seconds' worth of data. A timer is only
+// armed while there's something in the queue.
 class Throttler {
 public:
-    Throttler(State* state);
+    // Called for each released packet, with the time at which it was
+    // released (which can be slightly earlier than the current time).
+    // The output takes ownership of the packet.
+    typedef std::function<void(Packet*, ev_tstamp)> Output;
 
-    typedef std::function<void()> Callback;
+    // Queued packets are charged to "memory".
+    Throttler(State* state, MemoryAccount* memory, const Output& output);
+    ~Throttler();
 
-    // Activate the throttler, using these initial properties.
-    void enable(const LinkProperties& properties);
+    // Activate the throttler, using these initial properties. The
+    // volume events are taken from the compiled schedule.
+    void enable(const LinkProperties& properties,
+                std::shared_ptr<const VolumeEventSchedule> events);
 
     // Change the properties of the throttler / undo the changes.
     void apply(const LinkPropertiesChange& properties);
     void revert(const LinkPropertiesChange& properties);
 
-    // Call this callback as soon as we have at least "cost" units of
-    // capacity available. Note, callback might never get called.
-    void insert(uint64_t cost, const Callback& callback);
+    // Pass this packet to the output as soon as the link has capacity
+    // for it. Takes ownership of the packet; it might get dropped.
+    void insert(Packet* p);
+
+    // If the throttler would pass this packet straight to the output
+    // (i.e. it isn't limiting or dropping anything right now), account
+    // for it as if it had been inserted and return true; the caller then
+    // sends the packet itself. Otherwise return false, and the packet
+    // should be inserted normally.
+    bool pass_through(const Packet* p);
 
-    // True if this throttler has any callbacks we haven't yet called.
+    // True if this throttler has any packets we haven't yet released.
     bool has_queued_data() { return !queue_.empty(); }
 
 private:
-    // Add more tokens to the bucket.
-    void tick();
-    // Recompute the per-tick effects after a property change.
+    // Recompute the link rate after a property change.
     void recompute();
-    // Trigger callbacks until the queue is empty or we're out of tokens.
+    // Release all packets that are due, and schedule the release timer
+    // for the next one.
     void transmit();
+    // Drop the packet at the head of the queue, if there is one, to make
+    // room in the memory budget.
+    bool drop_oldest();
 
     // True if the throttler is enabled (false if no bandwidth throttler
-    // was specified in config -- in that case just call the callback
-    // right away).
+    // was specified in config -- in that case just pass packets to the
+    // output right away).
     bool enabled_;
 
     // Number of bytes of data ever put in the queue.
@@ -51,26 +74,30 @@ private:
     // Current configured bandwidth limit.
     int64_t throttle_kbps_;
 
-    // How many tokens are in the bucket.
-    uint64_t capacity_;
-    // Maximum tokens in the bucket (if reached, tick() does nothing).
-    uint64_t max_capacity_;
-    // Number of tokens to add per tick.
-    uint64_t capacity_per_tick_;
+    // Current bandwidth limit in bytes per second. Zero if the limit has
+    // been reduced to zero (or below), in which case nothing is released.
+    double bytes_per_second_;
+    // The virtual clock: the time at which the link will be done sending
+    // everything released so far. It lags the arrival time of a packet by
+    // at most 0.1 seconds, which is how much burst an idle link allows.
+    ev_tstamp link_free_at_;
 
-    Timer tick_timer_;
+    State* state_;
+    MemoryAccount* memory_;
+    Output output_;
+    WheelTimer release_timer_;
 
-    std::multimap<uint64_t, VolumeTriggeredEvent> pending_events_;
-    std::multimap<uint64_t, VolumeTriggeredEvent> active_events_;
+    // Progress through the profile's volume triggered events.
+    VolumeEventCursor volume_events_;
 
-    std::deque<std::pair<uint32_t, Callback>> queue_;
+    // Packets waiting for link capacity. Packet::timestamp_ is the time
+    // the packet was queued.
+    PacketQueue queue_;
 
-    // Amoutn of data currently in queue.
-    uint64_t queued_cost_;
     // Maximum amount of data in queue.
     uint64_t max_queue_;
-    // If larger than zero, drop the next callback and decrement this
-    // by the cost of the dropped callback.
+    // If larger than zero, drop the next packet and decrement this
+    // by the size of the dropped packet.
     int32_t drop_bytes_;
 };
 
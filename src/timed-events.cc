@@ -0,0 +1,131 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#include "timed-events.h"
+
+#include <algorithm>
+
+TimedEventSchedule::TimedEventSchedule(const FlowDisruptorProfile& profile) {
+    for (const auto& event : profile.timed_event()) {
+        uint32_t effect = effects_.size();
+        effects_.push_back(event.effect());
+
+        std::vector<Action>* list =
+            event.has_repeat_interval() && event.repeat_interval() > 0 ?
+            &repeating_ : &once_;
+        list->push_back({ event.trigger_time(), event.repeat_interval(),
+                          false, effect });
+        if (event.has_duration()) {
+            list->push_back({ event.trigger_time() + event.duration(),
+                              event.repeat_interval(), true, effect });
+        }
+    }
+
+    std::stable_sort(once_.begin(), once_.end(),
+                     [] (const Action& a, const Action& b) {
+                         return a.at < b.at;
+                     });
+}
+
+TimedEventCursor::TimedEventCursor(State* state, const Action& apply,
+                                   const Action& revert)
+    : state_(state),
+      start_(0),
+      cursor_(0),
+      scheduled_(0),
+      apply_(apply),
+      revert_(revert),
+      timer_(state->timer_wheel, [this] (WheelTimer*) { run(); }) {
+}
+
+void TimedEventCursor::start(
+    std::shared_ptr<const TimedEventSchedule> schedule, ev_tstamp start) {
+    schedule_ = schedule;
+    start_ = start;
+    cursor_ = 0;
+    repeats_.assign(schedule->repeating().size(), 0);
+
+    double next = next_action_time();
+    if (next >= 0) {
+        scheduled_ = next;
+        timer_.reschedule(start_ + next - ev_now(state_->loop));
+    } else {
+        timer_.stop();
+    }
+}
+
+double TimedEventCursor::next_action_time() const {
+    double next = -1;
+
+    const auto& once = schedule_->once();
+    if (cursor_ < once.size()) {
+        next = once[cursor_].at;
+    }
+
+    const auto& repeating = schedule_->repeating();
+    for (size_t i = 0; i < repeating.size(); ++i) {
+        double at = repeating[i].at +
+            repeats_[i] * repeating[i].repeat_interval;
+        if (next < 0 || at < next) {
+            next = at;
+        }
+    }
+
+    return next;
+}
+
+void TimedEventCursor::run() {
+    ev_tstamp now = ev_now(state_->loop);
+    // The wheel rounds times to its resolution, so it can fire a little
+    // before the exact time; the action we scheduled for is due anyway.
+    double elapsed = std::max(now - start_, scheduled_);
+
+    const auto& once = schedule_->once();
+    const auto& repeating = schedule_->repeating();
+
+    for (;;) {
+        // Find the earliest due action, either from the one-off list or
+        // the repeating ones.
+        const TimedEventSchedule::Action* action = NULL;
+        double at = elapsed;
+        size_t repeat_index = repeating.size();
+
+        if (cursor_ < once.size() && once[cursor_].at <= at) {
+            action = &once[cursor_];
+            at = action->at;
+        }
+        for (size_t i = 0; i < repeating.size(); ++i) {
+            double next = repeating[i].at +
+                repeats_[i] * repeating[i].repeat_interval;
+            if (next < at || (!action && next <= at)) {
+                action = &repeating[i];
+                at = next;
+                repeat_index = i;
+            }
+        }
+
+        if (!action) {
+            break;
+        }
+        if (repeat_index < repeating.size()) {
+            repeats_[repeat_index]++;
+        } else {
+            cursor_++;
+        }
+
+        const Effect& effect = schedule_->effect(action->effect);
+        if (action->revert) {
+            revert_(effect);
+        } else {
+            apply_(effect);
+        }
+    }
+
+    double next = next_action_time();
+    if (next >= 0) {
+        scheduled_ = next;
+        timer_.reschedule(start_ + next - now);
+    }
+}
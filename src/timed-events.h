@@ -0,0 +1,93 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+// Timed events, compiled once per profile into an immutable schedule.
+// Each connection follows the schedule with a cursor and a single wheel
+// timer, instead of having a timer and a copy of the event for each
+// configured event.
+
+#ifndef _TIMED_EVENTS_H_
+#define _TIMED_EVENTS_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "base.h"
+#include "FlowDisruptorConfig.pb.h"
+#include "timer-wheel.h"
+
+// The timed events of a profile, as a list of actions (applying or
+// reverting the effect of an event) at given times relative to the start
+// of the connection.
+class TimedEventSchedule {
+public:
+    struct Action {
+        // Time of the first occurrence, in seconds from connection start.
+        double at;
+        // Zero if the action only happens once.
+        double repeat_interval;
+        bool revert;
+        // Index into effects().
+        uint32_t effect;
+    };
+
+    explicit TimedEventSchedule(const FlowDisruptorProfile& profile);
+
+    // Actions that only happen once, sorted by time.
+    const std::vector<Action>& once() const { return once_; }
+    // Actions that repeat.
+    const std::vector<Action>& repeating() const { return repeating_; }
+    const Effect& effect(uint32_t index) const { return effects_[index]; }
+
+    bool empty() const { return once_.empty() && repeating_.empty(); }
+
+private:
+    std::vector<Action> once_;
+    std::vector<Action> repeating_;
+    std::vector<Effect> effects_;
+
+    DISALLOW_COPY_AND_ASSIGN(TimedEventSchedule);
+};
+
+// The position of one connection in a TimedEventSchedule.
+class TimedEventCursor {
+public:
+    typedef std::function<void(const Effect&)> Action;
+
+    TimedEventCursor(State* state, const Action& apply,
+                     const Action& revert);
+
+    // Start following the schedule, with time zero being "start" (which
+    // can be in the past; any actions already due run on the first tick).
+    void start(std::shared_ptr<const TimedEventSchedule> schedule,
+               ev_tstamp start);
+
+private:
+    // Run all actions that are due, and schedule the timer for the next.
+    void run();
+    // Time of the next action (relative to start_), or -1 if there's
+    // nothing left to do.
+    double next_action_time() const;
+
+    State* state_;
+    std::shared_ptr<const TimedEventSchedule> schedule_;
+    ev_tstamp start_;
+    // Index of the next action in schedule_->once().
+    uint32_t cursor_;
+    // Number of times each action in schedule_->repeating() has happened.
+    std::vector<uint32_t> repeats_;
+    // The time the timer was last scheduled for (relative to start_).
+    double scheduled_;
+
+    Action apply_;
+    Action revert_;
+    WheelTimer timer_;
+
+    DISALLOW_COPY_AND_ASSIGN(TimedEventCursor);
+};
+
+#endif // _TIMED_EVENTS_H_
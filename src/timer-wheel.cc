@@ -0,0 +1,338 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#include "timer-wheel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "log.h"
+
+// Level L of the wheel has kSlots slots, each covering 2^(kSlotBits * L)
+// ticks. A timer due "delta" ticks from now goes on the lowest level
+// whose total span is larger than delta, into the slot selected by the
+// corresponding bits of its expiry tick. Whenever the bits for a level
+// wrap around, the next slot of the level above is cascaded down.
+
+WheelTimer::WheelTimer(TimerWheel* wheel, const Callback& callback)
+    : wheel_(wheel),
+      callback_(callback),
+      slot_(-1),
+      expire_(0),
+      deadline_(0) {
+}
+
+WheelTimer::~WheelTimer() {
+    stop();
+}
+
+void WheelTimer::reschedule(ev_tstamp delay) {
+    uint64_t deadline =
+        wheel_->tick_at(ev_now(wheel_->state_->loop) + delay);
+    deadline_ = std::max(deadline, wheel_->now_);
+
+    // Common case: pushing the deadline further. Just leave the timer
+    // in its current slot.
+    if (slot_ >= 0 && deadline_ >= expire_) {
+        return;
+    }
+
+    stop();
+    wheel_->insert(this);
+}
+
+void WheelTimer::stop() {
+    if (slot_ >= 0) {
+        wheel_->remove(this);
+    } else if (linked()) {
+        // Waiting to be processed in a tick that's already in progress.
+        unlink();
+    }
+}
+
+TimerWheel::TimerWheel(State* state, double resolution)
+    : state_(state),
+      resolution_(resolution),
+      origin_(ev_now(state->loop)),
+      now_(0),
+      armed_(UINT64_MAX),
+      running_(false),
+      timer_(state, [this] (Timer*) { fired(); }),
+      budget_(0),
+      budget_exhausted_(NULL),
+      timerfd_(-1),
+      spin_(0) {
+    for (auto& bitmap : occupied_) {
+        bitmap = 0;
+    }
+}
+
+TimerWheel::~TimerWheel() {
+    if (timerfd_ >= 0) {
+        ev_io_stop(state_->loop, &timerfd_watcher_.watcher);
+        close(timerfd_);
+    }
+
+    for (auto& level : slots_) {
+        for (auto& head : level) {
+            while (head.linked()) {
+                remove(static_cast<WheelTimer*>(head.next));
+            }
+        }
+    }
+}
+
+uint64_t TimerWheel::tick_at(ev_tstamp time) const {
+    double tick = ceil((time - origin_) / resolution_);
+    return tick > 0 ? static_cast<uint64_t>(tick) : 0;
+}
+
+void TimerWheel::insert(WheelTimer* timer) {
+    bool empty = true;
+    for (auto bitmap : occupied_) {
+        if (bitmap) {
+            empty = false;
+        }
+    }
+    if (empty && !running_) {
+        // Nothing to process in between, skip straight to now.
+        now_ = std::max(now_, tick_at(ev_now(state_->loop)));
+    }
+
+    uint64_t expire = std::max(timer->deadline_, now_);
+    uint64_t delta = expire - now_;
+
+    int level = 0;
+    while (level < kLevels - 1 &&
+           delta >= (UINT64_C(1) << (kSlotBits * (level + 1)))) {
+        ++level;
+    }
+    if (delta >= (UINT64_C(1) << (kSlotBits * kLevels))) {
+        // Too far in the future. Park the timer at the end of the wheel,
+        // it'll get moved again once that's reached.
+        expire = now_ + (UINT64_C(1) << (kSlotBits * kLevels)) - 1;
+    }
+
+    int index = (expire >> (kSlotBits * level)) & (kSlots - 1);
+
+    timer->expire_ = expire;
+    timer->slot_ = level * kSlots + index;
+    timer->link(&slots_[level][index]);
+    occupied_[level] |= UINT64_C(1) << index;
+
+    if (!running_ && expire < armed_) {
+        arm(expire);
+    }
+}
+
+void TimerWheel::remove(WheelTimer* timer) {
+    int level = timer->slot_ / kSlots;
+    int index = timer->slot_ % kSlots;
+
+    timer->unlink();
+    timer->slot_ = -1;
+    if (!slots_[level][index].linked()) {
+        occupied_[level] &= ~(UINT64_C(1) << index);
+    }
+}
+
+void TimerWheel::cascade(int level, int index) {
+    TimerWheelNode* head = &slots_[level][index];
+
+    while (head->linked()) {
+        WheelTimer* timer = static_cast<WheelTimer*>(head->next);
+        remove(timer);
+        insert(timer);
+    }
+}
+
+int TimerWheel::process_tick(uint64_t tick) {
+    for (int level = kLevels - 1; level > 0; --level) {
+        uint64_t mask = (UINT64_C(1) << (kSlotBits * level)) - 1;
+        if ((tick & mask) == 0) {
+            cascade(level, (tick >> (kSlotBits * level)) & (kSlots - 1));
+        }
+    }
+
+    // Move the expired timers to a separate list first; callbacks are
+    // free to stop, reschedule or delete any timer.
+    int index = tick & (kSlots - 1);
+    TimerWheelNode expired;
+    TimerWheelNode* head = &slots_[0][index];
+    while (head->linked()) {
+        WheelTimer* timer = static_cast<WheelTimer*>(head->next);
+        remove(timer);
+        timer->link(&expired);
+    }
+
+    // Anything (re)inserted from here on goes to a later tick.
+    now_ = tick + 1;
+
+    int count = 0;
+    while (expired.linked()) {
+        WheelTimer* timer = static_cast<WheelTimer*>(expired.next);
+        timer->unlink();
+
+        if (timer->deadline_ > tick) {
+            insert(timer);
+        } else {
+            timer->callback_(timer);
+            ++count;
+        }
+    }
+    return count;
+}
+
+uint64_t TimerWheel::next_tick() const {
+    uint64_t next = UINT64_MAX;
+
+    for (int level = 0; level < kLevels; ++level) {
+        if (!occupied_[level]) {
+            continue;
+        }
+
+        int shift = kSlotBits * level;
+        int current = (now_ >> shift) & (kSlots - 1);
+        // Rotate so that the current slot is bit 0.
+        uint64_t bitmap = occupied_[level];
+        uint64_t rotated = current ?
+            (bitmap >> current) | (bitmap << (kSlots - current)) :
+            bitmap;
+        uint64_t base = (now_ >> shift) << shift;
+        if ((rotated & 1) && base < now_) {
+            // We're already past the start of the current slot, so the
+            // timers in it belong to the next rotation of this level.
+            // Any other slot comes first.
+            rotated &= ~UINT64_C(1);
+            if (!rotated) {
+                next = std::min(next,
+                                base + (UINT64_C(1) << (shift + kSlotBits)));
+                continue;
+            }
+        }
+        int distance = __builtin_ctzll(rotated);
+        next = std::min(next, base + (uint64_t(distance) << shift));
+    }
+
+    return next;
+}
+
+bool TimerWheel::use_precise_wakeups(double spin) {
+    timerfd_ = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerfd_ < 0) {
+        warn_with_errno("timerfd_create");
+        return false;
+    }
+    spin_ = spin;
+
+    timer_.stop();
+    timerfd_watcher_.payload = this;
+    ev_io_init(&timerfd_watcher_.watcher, precise_tramp, timerfd_, EV_READ);
+    ev_io_start(state_->loop, &timerfd_watcher_.watcher);
+
+    if (armed_ != UINT64_MAX) {
+        arm(armed_);
+    }
+    return true;
+}
+
+void TimerWheel::arm(uint64_t tick) {
+    armed_ = tick;
+    ev_tstamp at = origin_ + tick * resolution_;
+
+    if (timerfd_ < 0) {
+        ev_tstamp delay = at - ev_now(state_->loop);
+        timer_.reschedule(std::max(delay, 0.0));
+        return;
+    }
+
+    // ev_tstamp is wall-clock time, hence CLOCK_REALTIME. A time in the
+    // past fires right away; all zeroes would disarm the timer instead.
+    at = std::max(at - spin_, 1e-9);
+    struct itimerspec spec = {};
+    spec.it_value.tv_sec = static_cast<time_t>(at);
+    spec.it_value.tv_nsec =
+        static_cast<long>((at - spec.it_value.tv_sec) * 1e9);
+    if (timerfd_settime(timerfd_, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        fail_with_errno("timerfd_settime");
+    }
+}
+
+void TimerWheel::fired() {
+    if (armed_ == UINT64_MAX) {
+        return;
+    }
+
+    uint64_t tick = armed_;
+    armed_ = UINT64_MAX;
+    run(tick);
+}
+
+void TimerWheel::precise_tramp(struct ev_loop* loop, ev_io* w, int revents) {
+    auto watcher = reinterpret_cast<libev_watcher<ev_io, TimerWheel*>*>(w);
+    watcher->payload->precise_fired();
+}
+
+void TimerWheel::precise_fired() {
+    uint64_t expirations;
+    if (read(timerfd_, &expirations, sizeof(expirations)) < 0 ||
+        armed_ == UINT64_MAX) {
+        return;
+    }
+
+    ev_tstamp at = origin_ + armed_ * resolution_;
+    if (at - ev_time() > 2 * spin_) {
+        // Woke up way too early (e.g. the clock was stepped). Go back to
+        // sleep rather than spin.
+        arm(armed_);
+        return;
+    }
+    while (ev_time() < at) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    ev_now_update(state_->loop);
+    fired();
+}
+
+void TimerWheel::run(uint64_t fired_tick) {
+    // The last tick that's already in the past.
+    double elapsed = floor((ev_now(state_->loop) - origin_) / resolution_);
+    uint64_t current = std::max(fired_tick,
+                                static_cast<uint64_t>(std::max(elapsed, 0.0)));
+
+    running_ = true;
+    int count = 0;
+    while (now_ <= current) {
+        uint64_t next = next_tick();
+        if (next > current) {
+            now_ = current + 1;
+            break;
+        }
+        if (budget_ && count >= budget_) {
+            // The rest is overdue, so the wheel gets rearmed to run
+            // again right after the other pending events.
+            ++*budget_exhausted_;
+            break;
+        }
+
+        now_ = next;
+        count += process_tick(now_);
+    }
+    running_ = false;
+
+    if (batch_done_) {
+        batch_done_();
+    }
+
+    uint64_t next = next_tick();
+    if (next != UINT64_MAX) {
+        arm(next);
+    }
+}
@@ -0,0 +1,173 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+// A hierarchical timing wheel, driven by a single libev timer. Unlike
+// libev timers, which live in a heap shared by every timer in the
+// process, rescheduling a wheel timer to a later time is O(1) and only
+// touches the timer itself: the timer stays in its old slot, and is
+// moved to the new one when the old slot expires.
+//
+// There are two wheels: one with millisecond ticks for coarse timers
+// (idle timeouts, timed events), and one with microsecond ticks for
+// packet departures. All timers due by the time the libev timer fires
+// are run as a single batch.
+
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <cstdint>
+#include <functional>
+
+#include "base.h"
+#include "state.h"
+
+class TimerWheel;
+
+// Link in the intrusive timer lists of the wheel.
+struct TimerWheelNode {
+    TimerWheelNode()
+        : prev(this),
+          next(this) {
+    }
+
+    bool linked() const { return next != this; }
+
+    // Insert this node at the end of the list headed by "head".
+    void link(TimerWheelNode* head) {
+        prev = head->prev;
+        next = head;
+        head->prev->next = this;
+        head->prev = this;
+    }
+
+    void unlink() {
+        prev->next = next;
+        next->prev = prev;
+        prev = next = this;
+    }
+
+    TimerWheelNode* prev;
+    TimerWheelNode* next;
+};
+
+// A timer on a timing wheel. Same interface as Timer.
+class WheelTimer : private TimerWheelNode {
+public:
+    typedef std::function<void(WheelTimer*)> Callback;
+
+    WheelTimer(TimerWheel* wheel, const Callback& callback);
+    ~WheelTimer();
+
+    // Schedule the timer to be triggered at this many seconds from now
+    // (whether it's currently scheduled or not).
+    void reschedule(ev_tstamp delay);
+
+    // Cancel the timer.
+    void stop();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(WheelTimer);
+    friend class TimerWheel;
+
+    TimerWheel* wheel_;
+    Callback callback_;
+    // The wheel slot this timer is in, or -1 if it's not in any slot.
+    int slot_;
+    // The tick of the slot the timer is in.
+    uint64_t expire_;
+    // The tick at which the timer should actually trigger. Can be later
+    // than expire_, in which case the timer is moved once expire_ is
+    // reached.
+    uint64_t deadline_;
+};
+
+class TimerWheel {
+public:
+    // Make a wheel with ticks of "resolution" seconds.
+    TimerWheel(State* state, double resolution);
+    ~TimerWheel();
+
+    // Call this after each batch of timers has been run.
+    void set_batch_done(const std::function<void()>& batch_done) {
+        batch_done_ = batch_done;
+    }
+
+    // Run at most about "timers" timer callbacks per event loop
+    // iteration (always finishing the current tick), leaving the rest
+    // for the next iteration so that packet processing isn't starved.
+    // Each time that happens, increment "*exhausted". 0 for no limit.
+    void set_budget(int timers, uint64_t* exhausted) {
+        budget_ = timers;
+        budget_exhausted_ = exhausted;
+    }
+
+    // Wake up from a timerfd instead of a libev timer (libev only sleeps
+    // with millisecond granularity), waking "spin" seconds early and
+    // busy-waiting for the exact time. Return false if the timerfd can't
+    // be set up.
+    bool use_precise_wakeups(double spin);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(TimerWheel);
+    friend class WheelTimer;
+
+    static const int kLevels = 6;
+    static const int kSlotBits = 6;
+    static const int kSlots = 1 << kSlotBits;
+
+    // The tick number corresponding to a timestamp (rounded up).
+    uint64_t tick_at(ev_tstamp time) const;
+
+    // Put the timer in the slot for its deadline.
+    void insert(WheelTimer* timer);
+    // Take the timer out of its slot.
+    void remove(WheelTimer* timer);
+
+    // Process all ticks up to the current time (and at least up to
+    // "fired_tick"), then rearm the libev timer for the next tick with
+    // something to do.
+    void run(uint64_t fired_tick);
+    // Process a single tick, which must be now_. Advances now_ by one.
+    // Return the number of timers run.
+    int process_tick(uint64_t tick);
+    // Move all timers in this slot to lower levels.
+    void cascade(int level, int index);
+    // The earliest tick at which there might be something to do, or
+    // UINT64_MAX if the wheel is empty.
+    uint64_t next_tick() const;
+    void arm(uint64_t tick);
+    // The libev timer / timerfd fired.
+    void fired();
+    void precise_fired();
+    static void precise_tramp(struct ev_loop* loop, ev_io* w, int revents);
+
+    State* state_;
+    // Length of a tick, in seconds.
+    double resolution_;
+    // Time of tick 0.
+    ev_tstamp origin_;
+    // The next tick to process. Everything earlier has been processed.
+    uint64_t now_;
+    // The tick the libev timer is set for, or UINT64_MAX.
+    uint64_t armed_;
+    // True while processing ticks.
+    bool running_;
+
+    TimerWheelNode slots_[kLevels][kSlots];
+    // Bitmaps of the non-empty slots on each level.
+    uint64_t occupied_[kLevels];
+
+    Timer timer_;
+    std::function<void()> batch_done_;
+    int budget_;
+    uint64_t* budget_exhausted_;
+
+    // Precise wakeups, if enabled. Otherwise timerfd_ is -1.
+    int timerfd_;
+    double spin_;
+    libev_watcher<ev_io, TimerWheel*> timerfd_watcher_;
+};
+
+#endif // _TIMER_WHEEL_H_
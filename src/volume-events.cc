@@ -0,0 +1,138 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#include "volume-events.h"
+
+#include <algorithm>
+
+VolumeEventSchedule::VolumeEventSchedule(const LinkProperties& properties) {
+    for (const auto& event : properties.volume_event()) {
+        if (!event.has_trigger_at_bytes()) {
+            continue;
+        }
+
+        Event compiled;
+        compiled.trigger_at_bytes = event.trigger_at_bytes();
+        compiled.reverts = event.has_active_for_bytes();
+        compiled.active_for_bytes = event.active_for_bytes();
+        compiled.repeat_after_bytes = event.repeat_after_bytes();
+        compiled.effect.CopyFrom(event.effect());
+        events_.push_back(compiled);
+    }
+
+    // Stable, so that events with the same trigger point fire in
+    // configuration order.
+    std::stable_sort(events_.begin(), events_.end(),
+                     [] (const Event& a, const Event& b) {
+                         return a.trigger_at_bytes < b.trigger_at_bytes;
+                     });
+}
+
+VolumeEventCursor::VolumeEventCursor(const Action& apply,
+                                     const Action& revert)
+    : cursor_(0),
+      next_threshold_(UINT64_MAX),
+      apply_(apply),
+      revert_(revert) {
+}
+
+void VolumeEventCursor::reset(
+    std::shared_ptr<const VolumeEventSchedule> schedule) {
+    schedule_ = schedule;
+    cursor_ = 0;
+    rearmed_.clear();
+    update_next_threshold();
+}
+
+void VolumeEventCursor::trigger(uint32_t index, uint64_t at_bytes) {
+    const auto& event = schedule_->events()[index];
+    apply_(event.effect);
+
+    if (event.reverts) {
+        rearmed_.push_back({ at_bytes + event.active_for_bytes, index, true });
+    } else if (event.repeat_after_bytes) {
+        rearmed_.push_back({ at_bytes + event.repeat_after_bytes, index,
+                    false });
+    }
+}
+
+void VolumeEventCursor::fire(uint64_t total_bytes) {
+    const auto& events = schedule_->events();
+
+    // First trigger everything that's due (including repeats of events
+    // that become due again right away), in byte order...
+    for (;;) {
+        uint64_t best = UINT64_MAX;
+        size_t best_rearmed = rearmed_.size();
+        if (cursor_ < events.size() &&
+            events[cursor_].trigger_at_bytes <= total_bytes) {
+            best = events[cursor_].trigger_at_bytes;
+        }
+        for (size_t i = 0; i < rearmed_.size(); ++i) {
+            if (!rearmed_[i].active &&
+                rearmed_[i].at_bytes <= total_bytes &&
+                rearmed_[i].at_bytes < best) {
+                best = rearmed_[i].at_bytes;
+                best_rearmed = i;
+            }
+        }
+
+        if (best_rearmed < rearmed_.size()) {
+            uint32_t index = rearmed_[best_rearmed].index;
+            rearmed_[best_rearmed] = rearmed_.back();
+            rearmed_.pop_back();
+            trigger(index, best);
+        } else if (best != UINT64_MAX) {
+            trigger(cursor_++, best);
+        } else {
+            break;
+        }
+    }
+
+    // ... then revert the events whose active period is over.
+    for (;;) {
+        uint64_t best = UINT64_MAX;
+        size_t best_rearmed = rearmed_.size();
+        for (size_t i = 0; i < rearmed_.size(); ++i) {
+            if (rearmed_[i].active &&
+                rearmed_[i].at_bytes <= total_bytes &&
+                rearmed_[i].at_bytes < best) {
+                best = rearmed_[i].at_bytes;
+                best_rearmed = i;
+            }
+        }
+        if (best_rearmed == rearmed_.size()) {
+            break;
+        }
+
+        uint32_t index = rearmed_[best_rearmed].index;
+        rearmed_[best_rearmed] = rearmed_.back();
+        rearmed_.pop_back();
+
+        const auto& event = events[index];
+        revert_(event.effect);
+        if (event.repeat_after_bytes) {
+            rearmed_.push_back({ best + event.repeat_after_bytes, index,
+                        false });
+        }
+    }
+
+    update_next_threshold();
+}
+
+void VolumeEventCursor::update_next_threshold() {
+    next_threshold_ = UINT64_MAX;
+    if (!schedule_) {
+        return;
+    }
+
+    const auto& events = schedule_->events();
+    if (cursor_ < events.size()) {
+        next_threshold_ = events[cursor_].trigger_at_bytes;
+    }
+    for (const auto& rearmed : rearmed_) {
+        next_threshold_ = std::min(next_threshold_, rearmed.at_bytes);
+    }
+}
@@ -0,0 +1,90 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+// Volume triggered events, compiled once per profile into an immutable
+// schedule. Each throttler then tracks its progress through the schedule
+// with a cursor, so that the per-packet check is a single comparison.
+
+#ifndef _VOLUME_EVENTS_H_
+#define _VOLUME_EVENTS_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "base.h"
+#include "FlowDisruptorConfig.pb.h"
+
+// The volume events of one LinkProperties, sorted by the byte count at
+// which they first trigger.
+class VolumeEventSchedule {
+public:
+    struct Event {
+        uint64_t trigger_at_bytes;
+        // If false, the effect is never reverted.
+        bool reverts;
+        uint64_t active_for_bytes;
+        // Zero if the event doesn't repeat.
+        uint64_t repeat_after_bytes;
+        LinkPropertiesChange effect;
+    };
+
+    explicit VolumeEventSchedule(const LinkProperties& properties);
+
+    const std::vector<Event>& events() const { return events_; }
+    bool empty() const { return events_.empty(); }
+
+private:
+    std::vector<Event> events_;
+
+    DISALLOW_COPY_AND_ASSIGN(VolumeEventSchedule);
+};
+
+// The position of one throttler in a VolumeEventSchedule.
+class VolumeEventCursor {
+public:
+    typedef std::function<void(const LinkPropertiesChange&)> Action;
+
+    VolumeEventCursor(const Action& apply, const Action& revert);
+
+    void reset(std::shared_ptr<const VolumeEventSchedule> schedule);
+
+    // Called with the total number of bytes seen before the current
+    // packet. Applies and reverts the effects of any events that are due.
+    void advance(uint64_t total_bytes) {
+        if (total_bytes >= next_threshold_) {
+            fire(total_bytes);
+        }
+    }
+
+private:
+    // An event that has triggered at least once, and is either active
+    // (waiting to be reverted) or waiting to repeat.
+    struct Rearmed {
+        uint64_t at_bytes;
+        uint32_t index;
+        bool active;
+    };
+
+    void fire(uint64_t total_bytes);
+    void trigger(uint32_t index, uint64_t at_bytes);
+    void update_next_threshold();
+
+    std::shared_ptr<const VolumeEventSchedule> schedule_;
+    // Index of the first event in the schedule that hasn't triggered yet.
+    uint32_t cursor_;
+    std::vector<Rearmed> rearmed_;
+    // The lowest byte count at which anything happens; UINT64_MAX if
+    // nothing ever will.
+    uint64_t next_threshold_;
+
+    Action apply_;
+    Action revert_;
+
+    DISALLOW_COPY_AND_ASSIGN(VolumeEventCursor);
+};
+
+#endif // _VOLUME_EVENTS_H_
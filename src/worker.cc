@@ -0,0 +1,409 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+#include "worker.h"
+
+#include <algorithm>
+#include <google/gflags.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "connection.h"
+#include "connection-table.h"
+#include "delay-line.h"
+#include "delay-queue.h"
+#include "half-open.h"
+#include "log.h"
+#include "memory-budget.h"
+#include "pcap-writer.h"
+#include "realtime.h"
+#include "shared-throttler.h"
+#include "strutil.h"
+#include "timer-wheel.h"
+
+DECLARE_string(downlink_iface);
+DECLARE_string(uplink_iface);
+DECLARE_string(stats_file);
+DECLARE_double(stats_interval);
+DECLARE_bool(precision_pacing);
+DECLARE_double(pacing_spin_us);
+DECLARE_int32(delay_line_mb);
+DECLARE_string(delay_line_file);
+DECLARE_bool(delay_line_hugepages);
+DECLARE_int32(delay_line_spill_above);
+DECLARE_bool(pipeline);
+DECLARE_int32(busy_poll_us);
+DECLARE_int32(so_busy_poll_us);
+DECLARE_int32(downlink_iface_budget);
+DECLARE_int32(uplink_iface_budget);
+DECLARE_int32(timer_budget);
+
+// A name for the n'th of "count" copies of a file.
+static std::string shard_file(const std::string& file, int index,
+                              int count) {
+    if (count == 1) {
+        return file;
+    }
+    return stringprintf("%s.%d", file.c_str(), index);
+}
+
+Worker::Worker(int index, int count)
+    : index_(index),
+      count_(count),
+      cpu_(-1),
+      state_(index == 0 ? EV_DEFAULT : ev_loop_new(EVFLAG_AUTO)),
+      downlink_iface_(FLAGS_downlink_iface, IoInterface::DOWNLINK),
+      uplink_iface_(FLAGS_uplink_iface, IoInterface::UPLINK),
+      requests_(0),
+      stopping_(false),
+      busy_poll_sleeps_(state_.stats.counter("busy_poll.sleeps")) {
+    downlink_iface_.set_other(&uplink_iface_);
+    uplink_iface_.set_other(&downlink_iface_);
+
+    async_.payload = this;
+    ev_async_init(&async_.watcher, handle_request);
+    ev_async_start(state_.loop, &async_.watcher);
+
+    prepare_.payload = this;
+    ev_prepare_init(&prepare_.watcher, flush_ios);
+    ev_prepare_start(state_.loop, &prepare_.watcher);
+}
+
+Worker::~Worker() {
+    rx_.clear();
+    tx_.clear();
+    for (auto& io : ios_) {
+        io->close();
+    }
+    // Finish writing the trace files.
+    delete state_.pcap_writer;
+}
+
+void Worker::init(std::shared_ptr<const ConfigSnapshot> config) {
+    cpu_ = realtime_reserve_cpu();
+    state_.config.update(config);
+
+    state_.timer_wheel = new TimerWheel(&state_, 0.001);
+    if (FLAGS_precision_pacing) {
+        state_.departures = new TimerWheel(&state_, 0.000000001);
+        if (!state_.departures->use_precise_wakeups(FLAGS_pacing_spin_us *
+                                                    0.000001)) {
+            fail("Could not set up precision pacing");
+        }
+    } else {
+        state_.departures = new TimerWheel(&state_, 0.000001);
+    }
+    state_.timer_wheel->set_budget(
+        FLAGS_timer_budget, state_.stats.counter("budget.timers.exhausted"));
+    state_.departures->set_budget(
+        FLAGS_timer_budget,
+        state_.stats.counter("budget.departures.exhausted"));
+    state_.departure_lateness =
+        new DurationHistogram(&state_.stats, "departure_lateness");
+    state_.shared_downlink = new SharedThrottler(&state_, NULL);
+    state_.shared_uplink = new SharedThrottler(&state_, NULL);
+    state_.memory = new MemoryBudget(&state_.stats);
+    update_global_limits();
+    state_.delay_queue_pool = new DelayQueuePool(&state_.stats);
+    if (FLAGS_delay_line_mb > 0) {
+        state_.delay_line = new DelayLineStore(
+            &state_.stats, FLAGS_delay_line_mb * 1024ull * 1024 / count_,
+            FLAGS_delay_line_file.empty() ? "" :
+                shard_file(FLAGS_delay_line_file, index_, count_),
+            FLAGS_delay_line_hugepages,
+            std::max(FLAGS_delay_line_spill_above, 0));
+        if (!state_.delay_line->open()) {
+            fail("Could not set up the delay line store");
+        }
+    }
+    state_.pcap_writer = new PcapWriter(&state_);
+    state_.half_open = new HalfOpenTable(&state_);
+    state_.admission = new AdmissionControl(&state_);
+
+    State* state = &state_;
+    state_.stats.add_gauge("classifier.cache_hits", [state] () {
+            return state->config.classifier()->cache_hits();
+        });
+    state_.stats.add_gauge("classifier.cache_misses", [state] () {
+            return state->config.classifier()->cache_misses();
+        });
+    state_.stats.add_gauge("classifier.cache_size", [state] () {
+            return state->config.classifier()->cache_size();
+        });
+    state_.stats.add_gauge("classifier.index_fallbacks", [state] () {
+            return state->config.classifier()->index_fallbacks();
+        });
+    state_.stats.add_gauge("classifier.index_mismatches", [state] () {
+            return state->config.classifier()->index_mismatches();
+        });
+    state_.stats.add_gauge("classifier.residual_profiles", [state] () {
+            return state->config.classifier()->residual_profiles();
+        });
+
+    ios_.emplace_back(io_new_pcap(&downlink_iface_));
+    ios_.emplace_back(io_new_pcap(&uplink_iface_));
+
+    for (auto& io : ios_) {
+        if (!io->open()) {
+            fail("Could not open interface: '%s'", io->iface()->name().c_str());
+        }
+
+        if (count_ > 1) {
+            // One fanout group per interface. The kernel only allows
+            // sockets of the same interface in a group.
+            int group = (getpid() & 0x7fff) |
+                (io->iface()->direction() << 15);
+            if (!io->join_fanout(group)) {
+                fail("Could not share interface '%s' between workers",
+                     io->iface()->name().c_str());
+            }
+        }
+
+        if (FLAGS_so_busy_poll_us > 0 &&
+            !io->set_busy_poll(FLAGS_so_busy_poll_us)) {
+            warn("Could not enable SO_BUSY_POLL on '%s'",
+                 io->iface()->name().c_str());
+        }
+
+        int budget = std::max(
+            io->iface()->direction() == IoInterface::DOWNLINK ?
+                FLAGS_downlink_iface_budget : FLAGS_uplink_iface_budget,
+            1);
+
+        if (FLAGS_pipeline) {
+            rx_.emplace_back(new PipelineRx(&state_, io.get(), budget,
+                                            [this] (Packet* p) {
+                                                process(p);
+                                            }));
+            tx_.emplace_back(new PipelineTx(&state_, io.get()));
+            continue;
+        }
+
+        IoSource* source = new IoSource();
+        source->worker = this;
+        source->io = io.get();
+        source->budget = budget;
+        source->exhausted = state_.stats.counter(
+            "budget." + io->iface()->name() + ".exhausted");
+        sources_.emplace_back(source);
+
+        int fd = io->select_fd();
+        if (fd >= 0) {
+            IoWatcher* watcher = new IoWatcher();
+            watcher->payload = source;
+            io_watchers_.emplace_back(watcher);
+            ev_io_init(&watcher->watcher, handle_packet, fd, EV_READ);
+            ev_io_start(state_.loop, &watcher->watcher);
+        }
+    }
+
+    // Packets released in the same batch of departures are flushed out
+    // together.
+    state_.departures->set_batch_done([this] () {
+            downlink_iface_.io()->flush();
+            uplink_iface_.io()->flush();
+        });
+
+    stats_timer_.reset(new Timer(&state_, [this] (Timer* timer) {
+                export_stats();
+                timer->reschedule(FLAGS_stats_interval);
+            }));
+    if (!FLAGS_stats_file.empty()) {
+        stats_timer_->reschedule(FLAGS_stats_interval);
+    }
+}
+
+void Worker::run() {
+    realtime_thread(cpu_, stringprintf("worker %d", index_));
+
+    for (auto& tx : tx_) {
+        tx->start();
+    }
+    for (auto& rx : rx_) {
+        rx->start();
+    }
+
+    if (FLAGS_busy_poll_us > 0) {
+        busy_poll();
+    } else {
+        ev_run(state_.loop, 0);
+    }
+
+    for (auto& rx : rx_) {
+        rx->stop();
+    }
+    for (auto& tx : tx_) {
+        tx->stop();
+    }
+}
+
+void Worker::start() {
+    thread_ = std::thread([this] () { run(); });
+}
+
+void Worker::join() {
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void Worker::publish_config(std::shared_ptr<const ConfigSnapshot> config) {
+    std::atomic_store(&pending_config_, config);
+    post(RELOAD);
+}
+
+void Worker::request_stats() {
+    post(STATS);
+}
+
+void Worker::request_stop() {
+    post(STOP);
+}
+
+void Worker::post(Request request) {
+    requests_ |= request;
+    ev_async_send(state_.loop, &async_.watcher);
+}
+
+void Worker::handle_request(struct ev_loop* loop, ev_async* w, int revents) {
+    Worker* worker = reinterpret_cast<AsyncWatcher*>(w)->payload;
+    int requests = worker->requests_.exchange(0);
+
+    if (requests & RELOAD) {
+        worker->update_config();
+    }
+    if (requests & STATS) {
+        worker->state_.stats.log();
+        worker->export_stats();
+    }
+    if (requests & STOP) {
+        worker->stopping_ = true;
+        ev_unloop(loop, EVUNLOOP_ALL);
+    }
+}
+
+void Worker::flush_ios(struct ev_loop* loop, ev_prepare* w, int revents) {
+    Worker* worker = reinterpret_cast<PrepareWatcher*>(w)->payload;
+    worker->downlink_iface_.io()->flush();
+    worker->uplink_iface_.io()->flush();
+}
+
+void Worker::handle_packet(struct ev_loop* loop, ev_io* w, int revents) {
+    IoSource* source = reinterpret_cast<IoWatcher*>(w)->payload;
+    // Anything left over is handled on the next loop iteration, after
+    // the other interface and the timers have had their turn.
+    source->worker->receive_batch(source);
+}
+
+bool Worker::receive_batch(IoSource* source) {
+    Packet p;
+    int received = 0;
+
+    while (received < source->budget && source->io->receive(&p)) {
+        process(&p);
+        p.release();
+        ++received;
+    }
+
+    if (received == source->budget) {
+        ++*source->exhausted;
+    }
+    return received > 0;
+}
+
+void Worker::busy_poll() {
+    const double idle_limit = FLAGS_busy_poll_us * 0.000001;
+    ev_tstamp last_packet = ev_now(state_.loop);
+
+    while (!stopping_) {
+        if (poll_packets()) {
+            last_packet = ev_now(state_.loop);
+        }
+
+        if (ev_now(state_.loop) - last_packet < idle_limit) {
+            // Run the timers and other events, without sleeping.
+            ev_run(state_.loop, EVRUN_NOWAIT);
+        } else {
+            // Idle for long enough; sleep until something happens, and
+            // then start spinning again.
+            ++*busy_poll_sleeps_;
+            ev_run(state_.loop, EVRUN_ONCE);
+            last_packet = ev_now(state_.loop);
+        }
+    }
+}
+
+bool Worker::poll_packets() {
+    bool received = false;
+
+    if (!rx_.empty()) {
+        for (auto& rx : rx_) {
+            received |= rx->poll();
+        }
+        return received;
+    }
+
+    for (auto& source : sources_) {
+        received |= receive_batch(source.get());
+    }
+    return received;
+}
+
+void Worker::process(Packet* p) {
+    if (p->has_tcp()) {
+        handle_tcp(p);
+    } else {
+        // Forward all other packets straight through
+        p->from_iface_->other()->io()->inject(p);
+    }
+}
+
+void Worker::handle_tcp(Packet* p) {
+    Connection* connection = state_.connections->get_connection_for_packet(p);
+
+    if (!connection) {
+        if (state_.half_open->receive(p)) {
+            return;
+        }
+
+        if (p->tcp().syn() && !p->tcp().ack()) {
+            Profile* profile = state_.config.classify(p);
+            if (profile) {
+                if (state_.admission->admit(profile)) {
+                    state_.half_open->add(profile, p);
+                    p->from_iface_->other()->io()->inject(p);
+                }
+                return;
+            }
+        }
+
+        p->from_iface_->other()->io()->inject(p);
+        return;
+    } else {
+        connection->receive(p);
+    }
+}
+
+void Worker::update_config() {
+    std::shared_ptr<const ConfigSnapshot> config =
+        std::atomic_exchange(&pending_config_,
+                             std::shared_ptr<const ConfigSnapshot>());
+    if (config) {
+        state_.config.update(config);
+        update_global_limits();
+    }
+}
+
+void Worker::update_global_limits() {
+    state_.shared_downlink->update(state_.config.config().downlink());
+    state_.shared_uplink->update(state_.config.config().uplink());
+    state_.memory->update(state_.config.config().memory());
+}
+
+void Worker::export_stats() {
+    if (!FLAGS_stats_file.empty()) {
+        state_.stats.write(shard_file(FLAGS_stats_file, index_, count_));
+    }
+}
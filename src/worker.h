@@ -0,0 +1,127 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+// One shard of the data plane. Each worker has its own event loop,
+// connections, timers, throttlers and copy of the configuration, and its
+// own handles on both interfaces. With several workers, the kernel
+// spreads the packets between them by a symmetric flow hash
+// (PACKET_FANOUT_HASH), so both directions of a connection are always
+// handled by the same worker and workers never share any state.
+
+#ifndef _WORKER_H_
+#define _WORKER_H_
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "base.h"
+#include "iface.h"
+#include "io-backend.h"
+#include "pipeline.h"
+#include "state.h"
+
+class Worker {
+public:
+    // Worker "index" of "count". The first worker uses the default event
+    // loop, and is the one that should handle signals.
+    Worker(int index, int count);
+    ~Worker();
+
+    // Start using this configuration, and open the interfaces. The
+    // workers must be initialized in order, so that the n'th member of
+    // each fanout group is the same worker.
+    void init(std::shared_ptr<const ConfigSnapshot> config);
+
+    // Run the event loop until stopped, in this thread or a new one.
+    void run();
+    void start();
+    void join();
+
+    // Switch to a new configuration / log and export the statistics /
+    // stop the event loop. Can be called from any thread; the work is
+    // done in the worker's own thread.
+    void publish_config(std::shared_ptr<const ConfigSnapshot> config);
+    void request_stats();
+    void request_stop();
+
+    State* state() { return &state_; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(Worker);
+
+    // An interface, and how many packets to read from it per loop
+    // iteration.
+    struct IoSource {
+        Worker* worker;
+        IoBackend* io;
+        int budget;
+        // Times the whole budget was used up.
+        uint64_t* exhausted;
+    };
+
+    typedef libev_watcher<ev_io, IoSource*> IoWatcher;
+    typedef libev_watcher<ev_async, Worker*> AsyncWatcher;
+    typedef libev_watcher<ev_prepare, Worker*> PrepareWatcher;
+
+    enum Request {
+        RELOAD = 1,
+        STATS = 2,
+        STOP = 4,
+    };
+
+    static void handle_packet(struct ev_loop* loop, ev_io* w, int revents);
+    static void handle_request(struct ev_loop* loop, ev_async* w,
+                               int revents);
+    // Send the packets the interfaces have batched up, before the event
+    // loop waits for more.
+    static void flush_ios(struct ev_loop* loop, ev_prepare* w, int revents);
+    void process(Packet* p);
+    void handle_tcp(Packet* p);
+    // Run the event loop, but spin on the interfaces instead of
+    // sleeping for as long as packets keep arriving.
+    void busy_poll();
+    // Handle the packets waiting on the interfaces. Return true if there
+    // were any.
+    bool poll_packets();
+    // Handle up to the budget of packets waiting on this interface.
+    // Return true if there were any.
+    bool receive_batch(IoSource* source);
+
+    void post(Request request);
+    void update_config();
+    void update_global_limits();
+    void export_stats();
+
+    int index_;
+    int count_;
+    // In real-time mode, the CPU for the event loop thread (or -1).
+    int cpu_;
+    State state_;
+
+    IoInterface downlink_iface_;
+    IoInterface uplink_iface_;
+    std::vector<std::unique_ptr<IoBackend> > ios_;
+    std::vector<std::unique_ptr<IoSource> > sources_;
+    std::vector<std::unique_ptr<IoWatcher> > io_watchers_;
+    // In pipeline mode, the threads reading from and writing to ios_.
+    std::vector<std::unique_ptr<PipelineRx> > rx_;
+    std::vector<std::unique_ptr<PipelineTx> > tx_;
+
+    AsyncWatcher async_;
+    PrepareWatcher prepare_;
+    std::atomic<int> requests_;
+    bool stopping_;
+    // The newest published configuration, until the worker picks it up.
+    // Only accessed with std::atomic_load / atomic_exchange.
+    std::shared_ptr<const ConfigSnapshot> pending_config_;
+    std::unique_ptr<Timer> stats_timer_;
+    // Times the busy poll loop gave up and went to sleep.
+    uint64_t* busy_poll_sleeps_;
+    std::thread thread_;
+};
+
+#endif // _WORKER_H_
@@ -0,0 +1,294 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Copyright 2015 Teclo Networks AG
+ */
+
+// Checks that compiled filter programs give the same result as
+// libpcap's bpf_filter(), for a set of edge cases and for lots of
+// random programs run on random packets. Exits with a non-zero status
+// if any result differs.
+
+#include <cstdint>
+#include <cstdio>
+#include <pcap.h>
+#include <random>
+#include <vector>
+
+#include "bpf-jit.h"
+
+// Longest packet to test with.
+static const u_int kMaxPacket = 128;
+
+static std::mt19937 rng(1);
+static int programs = 0;
+static int mismatches = 0;
+
+static uint32_t random_below(uint32_t n) {
+    return rng() % n;
+}
+
+// A random constant, biased toward values near packet offsets and
+// toward ones where 32-bit arithmetic wraps.
+static uint32_t random_k() {
+    switch (random_below(6)) {
+    case 0:
+        return random_below(4) ? random_below(100) :
+            0xfffffff0u + random_below(16);
+    case 1:
+        return random_below(2) ? 0x7fffffffu + random_below(3) : 0;
+    case 2:
+        return random_below(40);
+    default:
+        return rng();
+    }
+}
+
+static bpf_insn insn(uint16_t code, uint32_t k) {
+    bpf_insn result;
+    result.code = code;
+    result.jt = 0;
+    result.jf = 0;
+    result.k = k;
+    return result;
+}
+
+// Run the program on a "buflen" byte prefix of "data", with the JIT and
+// with bpf_filter(). The packet is copied to a buffer of exactly that
+// size, so that a sanitizer can catch reads past the end.
+static void compare(const BpfJit& jit, const std::vector<bpf_insn>& program,
+                    const u_char* data, u_int wirelen, u_int buflen) {
+    std::vector<u_char> packet(data, data + buflen);
+    u_int expected = bpf_filter(program.data(), packet.data(), wirelen,
+                                buflen);
+    u_int actual = jit.run(packet.data(), wirelen, buflen);
+
+    if (expected != actual) {
+        if (++mismatches <= 10) {
+            fprintf(stderr, "program %d, buflen %u: bpf_filter returned %u, "
+                    "compiled program %u\n", programs, buflen, expected,
+                    actual);
+        }
+    }
+}
+
+static std::unique_ptr<BpfJit> compile(std::vector<bpf_insn>* program) {
+    struct bpf_program bpf;
+    bpf.bf_len = program->size();
+    bpf.bf_insns = program->data();
+    ++programs;
+    return BpfJit::compile(&bpf);
+}
+
+// Compile a program that must be accepted, and compare the results on
+// every packet length up to kMaxPacket.
+static void check_fixed(const char* name, std::vector<bpf_insn> program) {
+    std::unique_ptr<BpfJit> jit = compile(&program);
+    if (!jit) {
+        fprintf(stderr, "%s: not compiled\n", name);
+        ++mismatches;
+        return;
+    }
+
+    u_char data[kMaxPacket];
+    for (u_int i = 0; i < kMaxPacket; ++i) {
+        data[i] = rng();
+    }
+    for (u_int buflen = 0; buflen <= kMaxPacket; ++buflen) {
+        compare(*jit, program, data, buflen, buflen);
+    }
+}
+
+static void check_rejected(const char* name, std::vector<bpf_insn> program) {
+    if (compile(&program)) {
+        fprintf(stderr, "%s: compiled\n", name);
+        ++mismatches;
+    }
+}
+
+static void check_fixed_programs() {
+    static const uint16_t kSizes[] = { BPF_W, BPF_H, BPF_B };
+    static const uint32_t kOffsets[] = {
+        0, 1, 13, 14, 60, 126, 127, 128, 0x7fffffff, 0xfffffffe, 0xffffffff,
+    };
+    static const uint32_t kIndexes[] = {
+        0, 4, 0x80000000, 0xfffffff0, 0xfffffffe, 0xffffffff,
+    };
+
+    // Loads at or past the end of the packet.
+    for (uint16_t size : kSizes) {
+        for (uint32_t k : kOffsets) {
+            check_fixed("ld abs", {
+                    insn(BPF_LD|size|BPF_ABS, k),
+                    insn(BPF_RET|BPF_A, 0),
+                });
+        }
+    }
+
+    // Indexed loads where X + k wraps around to a valid offset.
+    for (uint16_t size : kSizes) {
+        for (uint32_t x : kIndexes) {
+            for (uint32_t k : kOffsets) {
+                check_fixed("ld ind", {
+                        insn(BPF_LDX|BPF_W|BPF_IMM, x),
+                        insn(BPF_LD|size|BPF_IND, k),
+                        insn(BPF_RET|BPF_A, 0),
+                    });
+            }
+        }
+    }
+
+    // The IP header length idiom, also past the end of the packet.
+    for (uint32_t k : kOffsets) {
+        check_fixed("ldx msh", {
+                insn(BPF_LDX|BPF_MSH|BPF_B, k),
+                insn(BPF_MISC|BPF_TXA, 0),
+                insn(BPF_RET|BPF_A, 0),
+            });
+    }
+
+    // Division by a zero X ends the program with 0.
+    for (uint16_t op : { BPF_DIV, BPF_MOD }) {
+        for (uint32_t x : { 0u, 1u, 7u }) {
+            check_fixed("div x", {
+                    insn(BPF_LDX|BPF_W|BPF_IMM, x),
+                    insn(BPF_LD|BPF_IMM, 12345),
+                    insn(BPF_ALU|op|BPF_X, 0),
+                    insn(BPF_RET|BPF_K, 1),
+                });
+        }
+    }
+
+    // Shifts by X of 32 or more.
+    for (uint16_t op : { BPF_LSH, BPF_RSH }) {
+        for (uint32_t x : { 0u, 1u, 31u, 32u, 33u, 64u, 0xffffffffu }) {
+            check_fixed("shift x", {
+                    insn(BPF_LDX|BPF_W|BPF_IMM, x),
+                    insn(BPF_LD|BPF_IMM, 0x80000001),
+                    insn(BPF_ALU|op|BPF_X, 0),
+                    insn(BPF_RET|BPF_A, 0),
+                });
+        }
+    }
+
+    check_rejected("no return", {
+            insn(BPF_LD|BPF_IMM, 1),
+        });
+    check_rejected("jump past the end", {
+            insn(BPF_JMP|BPF_JA, 5),
+            insn(BPF_RET|BPF_K, 1),
+        });
+    check_rejected("division by zero", {
+            insn(BPF_ALU|BPF_DIV|BPF_K, 0),
+            insn(BPF_RET|BPF_K, 1),
+        });
+    check_rejected("unknown opcode", {
+            insn(0xff, 0),
+            insn(BPF_RET|BPF_K, 1),
+        });
+}
+
+// A random valid program: one that only jumps forward within the
+// program, doesn't divide by a zero constant and ends in a return.
+static std::vector<bpf_insn> random_program() {
+    static const uint16_t kOps[] = {
+        BPF_LD|BPF_W|BPF_ABS, BPF_LD|BPF_H|BPF_ABS, BPF_LD|BPF_B|BPF_ABS,
+        BPF_LD|BPF_W|BPF_IND, BPF_LD|BPF_H|BPF_IND, BPF_LD|BPF_B|BPF_IND,
+        BPF_LD|BPF_W|BPF_LEN, BPF_LDX|BPF_W|BPF_LEN, BPF_LDX|BPF_MSH|BPF_B,
+        BPF_LD|BPF_IMM, BPF_LDX|BPF_W|BPF_IMM, BPF_LD|BPF_MEM,
+        BPF_LDX|BPF_MEM, BPF_ST, BPF_STX,
+        BPF_JMP|BPF_JA, BPF_JMP|BPF_JGT, BPF_JMP|BPF_JGE, BPF_JMP|BPF_JEQ,
+        BPF_JMP|BPF_JSET, BPF_JMP|BPF_JGT|BPF_X, BPF_JMP|BPF_JGE|BPF_X,
+        BPF_JMP|BPF_JEQ|BPF_X, BPF_JMP|BPF_JSET|BPF_X,
+        BPF_ALU|BPF_ADD, BPF_ALU|BPF_SUB, BPF_ALU|BPF_MUL, BPF_ALU|BPF_DIV,
+        BPF_ALU|BPF_MOD, BPF_ALU|BPF_AND, BPF_ALU|BPF_OR, BPF_ALU|BPF_XOR,
+        BPF_ALU|BPF_LSH, BPF_ALU|BPF_RSH,
+        BPF_ALU|BPF_ADD|BPF_X, BPF_ALU|BPF_SUB|BPF_X, BPF_ALU|BPF_MUL|BPF_X,
+        BPF_ALU|BPF_DIV|BPF_X, BPF_ALU|BPF_MOD|BPF_X, BPF_ALU|BPF_AND|BPF_X,
+        BPF_ALU|BPF_OR|BPF_X, BPF_ALU|BPF_XOR|BPF_X, BPF_ALU|BPF_LSH|BPF_X,
+        BPF_ALU|BPF_RSH|BPF_X,
+        BPF_ALU|BPF_NEG, BPF_MISC|BPF_TAX, BPF_MISC|BPF_TXA,
+        BPF_RET|BPF_A, BPF_RET|BPF_K,
+    };
+    std::vector<bpf_insn> program;
+
+    // bpf_filter() doesn't initialize the scratch memory, so store to
+    // all of it before anything can load from it.
+    for (uint32_t i = 0; i < BPF_MEMWORDS; ++i) {
+        program.push_back(insn(BPF_ST, i));
+    }
+
+    int count = 1 + random_below(40);
+    for (int i = 0; i < count; ++i) {
+        bpf_insn in = insn(kOps[random_below(sizeof(kOps) / sizeof(kOps[0]))],
+                           random_k());
+        int left = count - i - 1;
+
+        if (BPF_CLASS(in.code) == BPF_JMP) {
+            if (left == 0) {
+                in.code = BPF_RET|BPF_A;
+            } else if (in.code == (BPF_JMP|BPF_JA)) {
+                in.k = random_below(left);
+            } else {
+                in.jt = random_below(left);
+                in.jf = random_below(left);
+            }
+        }
+        switch (in.code) {
+        case BPF_ST:
+        case BPF_STX:
+        case BPF_LD|BPF_MEM:
+        case BPF_LDX|BPF_MEM:
+            in.k = random_below(BPF_MEMWORDS);
+            break;
+        case BPF_ALU|BPF_DIV:
+        case BPF_ALU|BPF_MOD:
+            if (in.k == 0) {
+                in.k = 3;
+            }
+            break;
+        case BPF_ALU|BPF_LSH:
+        case BPF_ALU|BPF_RSH:
+            in.k = random_below(32);
+            break;
+        case BPF_LDX|BPF_W|BPF_IMM:
+            if (random_below(2)) {
+                in.k = random_below(40);
+            }
+            break;
+        }
+        program.push_back(in);
+    }
+    program.push_back(insn(BPF_RET|BPF_A, 0));
+
+    return program;
+}
+
+static void check_random_programs(int count) {
+    for (int i = 0; i < count; ++i) {
+        std::vector<bpf_insn> program = random_program();
+        std::unique_ptr<BpfJit> jit = compile(&program);
+        if (!jit) {
+            fprintf(stderr, "program %d: not compiled\n", programs);
+            ++mismatches;
+            continue;
+        }
+
+        for (int j = 0; j < 50; ++j) {
+            u_char data[kMaxPacket];
+            for (u_int k = 0; k < kMaxPacket; ++k) {
+                data[k] = rng();
+            }
+            u_int buflen = random_below(4) ? random_below(80) :
+                random_below(kMaxPacket + 1);
+            compare(*jit, program, data, buflen + random_below(3), buflen);
+        }
+    }
+}
+
+int main() {
+    check_fixed_programs();
+    check_random_programs(20000);
+
+    printf("%d programs, %d mismatches\n", programs, mismatches);
+    return mismatches ? 1 : 0;
+}